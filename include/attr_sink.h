@@ -0,0 +1,52 @@
+/*
+	Deferred file attributes
+*/
+#ifndef __ATTR_SINK_H
+#define __ATTR_SINK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Attributes to apply to an entry */
+#define ATTR_MODE	(1 << 0)
+#define ATTR_OWNER	(1 << 1)
+#define ATTR_TIME	(1 << 2)
+
+/*
+ * Collects the ownership, mode, time and xattrs of extracted entries so
+ * that they can be applied once the whole tree has been written, instead
+ * of a few path based syscalls per file while extracting.
+ *
+ * Entries are stored relative to their parent directory; the final pass
+ * opens every directory once and applies the attributes of its entries
+ * with the *at() syscalls, files first and then directories from the
+ * deepest up, so that restrictive directory modes never get in the way
+ * of their own contents.
+ */
+struct attr_sink;
+
+struct attr_sink *attr_sink_new(void);
+
+/*
+ * Records the attributes of path, which must already exist.
+ * mode must include the file type bits: symlinks are never followed and
+ * directories are applied after all the other entries.
+ * Returns a handle to attach xattrs to, or -1 on error.
+ * Can be called from several threads.
+ */
+int attr_sink_add(struct attr_sink *sink, const char *path, int flags, mode_t mode, uid_t uid, gid_t gid, time_t mtime);
+int attr_sink_xattr(struct attr_sink *sink, int entry, const char *name, const void *value, size_t size);
+
+/* Applies all the recorded attributes, returns the number of failures */
+int attr_sink_apply(struct attr_sink *sink, int nThreads);
+void attr_sink_free(struct attr_sink *sink);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
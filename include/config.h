@@ -11,6 +11,10 @@ typedef struct {
 	char *config_dir;
 	char *dest_dir;
 	int enableSignatureChecking;
+	char *squashfs_path;
+	int squashfs_dedup;
+	char *squashfs_tar;
+	int ts_index_interval;
 } config_opts_t;
 
 extern config_opts_t config_opts;
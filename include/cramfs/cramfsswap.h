@@ -1,4 +0,0 @@
-#ifndef __CRAMFSSWAP_H
-#define __CRAMFSSWAP_H
-int cramswap(char *sinfile, char *soutfile);
-#endif //__CRAMFSSWAP_H
@@ -204,6 +204,52 @@ struct jffs2_raw_summary
 	__u32 sum[0]; 	/* inode summary info */
 };
 
+/* Summary records, one per node of the eraseblock */
+struct jffs2_sum_inode_flash
+{
+	__u16 nodetype;	/* = JFFS2_NODETYPE_INODE */
+	__u32 inode;	/* inode number */
+	__u32 version;	/* inode version */
+	__u32 offset;	/* offset in the eraseblock */
+	__u32 totlen;	/* node length */
+} __attribute__((packed));
+
+struct jffs2_sum_dirent_flash
+{
+	__u16 nodetype;	/* = JFFS2_NODETYPE_DIRENT */
+	__u32 totlen;	/* node length */
+	__u32 offset;	/* offset in the eraseblock */
+	__u32 pino;		/* parent inode */
+	__u32 version;	/* dirent version */
+	__u32 ino;		/* == zero for unlink */
+	__u8 nsize;		/* dirent name size */
+	__u8 type;		/* dirent type */
+	__u8 name[0];	/* dirent name */
+} __attribute__((packed));
+
+struct jffs2_sum_xattr_flash
+{
+	__u16 nodetype;	/* = JFFS2_NODETYPE_XATTR */
+	__u32 xid;		/* XATTR identifier number */
+	__u32 version;
+	__u32 offset;	/* offset in the eraseblock */
+	__u32 totlen;	/* node length */
+} __attribute__((packed));
+
+struct jffs2_sum_xref_flash
+{
+	__u16 nodetype;	/* = JFFS2_NODETYPE_XREF */
+	__u32 offset;	/* offset in the eraseblock */
+	__u32 totlen;	/* node length */
+} __attribute__((packed));
+
+/* Last 8 bytes of an eraseblock that has a summary */
+struct jffs2_sum_marker
+{
+	__u32 offset;	/* offset of the summary node in the eraseblock */
+	__u32 magic;	/* = JFFS2_SUM_MAGIC */
+};
+
 union jffs2_node_union
 {
 	struct jffs2_raw_inode i;
@@ -24,7 +24,7 @@
  *
  */
 
-#    if !defined(linux) && !defined(__CYGWIN__)
+#    if !defined(__linux__) && !defined(__CYGWIN__)
 #        define __BYTE_ORDER BYTE_ORDER
 #        define __BIG_ENDIAN BIG_ENDIAN
 #        define __LITTLE_ENDIAN LITTLE_ENDIAN
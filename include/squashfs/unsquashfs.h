@@ -52,7 +52,7 @@
 #        define FNM_EXTMATCH  (1 << 5)
 #    endif
 
-#    if !defined(linux) && !defined(__CYGWIN__)
+#    if !defined(__linux__) && !defined(__CYGWIN__)
 #        define __BYTE_ORDER BYTE_ORDER
 #        define __BIG_ENDIAN BIG_ENDIAN
 #        define __LITTLE_ENDIAN LITTLE_ENDIAN
@@ -80,6 +80,7 @@ struct super_block {
 struct hash_table_entry {
 	long long start;
 	int bytes;
+	int run_end;
 	struct hash_table_entry *next;
 };
 
@@ -167,6 +168,14 @@ struct queue {
 
 #    define DIR_ENT_SIZE	16
 
+/*
+ * Regular files are created readable and writable by their owner, so that
+ * duplicates can still be copied from them, the mode from the inode is
+ * applied with the deferred attributes
+ */
+#    define FILE_CREATE_MODE(mode)	(((mode) & 0777) | S_IRUSR | S_IWUSR)
+#    define FILE_MODE_WIDENED(mode)	(((mode) & 0600) != 0600)
+
 struct dir_ent {
 	char name[SQUASHFS_NAME_LEN + 1];
 	unsigned int start_block;
@@ -202,6 +211,10 @@ struct squashfs_file {
 	char *pathname;
 	char sparse;
 	unsigned int xattr;
+	struct dedup_entry *dup;
+	char typeflag;		/* tar entry type */
+	char *link;		/* symlink or hardlink target, for tar */
+	long long rdev;
 };
 
 struct path_entry {
@@ -235,17 +248,27 @@ extern int lookup_type[];
 extern int fd;
 extern struct queue *to_reader, *to_inflate, *to_writer;
 extern struct cache *fragment_cache, *data_cache;
+extern int lazy_metadata;
+extern struct attr_sink *attr_sink;
 
 /* unsquashfs.c */
 extern int lookup_entry(struct hash_table_entry **, long long);
+extern int lookup_inode_entry(long long, int);
+extern int lookup_directory_entry(long long, int);
 extern int read_fs_bytes(int fd, long long, int, void *);
 extern int read_block(int, long long, long long *, int, void *);
+extern int set_attributes(char *, int, uid_t, gid_t, time_t, unsigned int, unsigned int);
+extern int write_bytes(int, char *, int);
+extern int open_wait(char *, int, mode_t);
+extern void close_wake(int);
 extern void enable_progress_bar();
 extern void disable_progress_bar();
 extern void dump_queue(struct queue *);
 extern void dump_cache(struct cache *);
 extern int is_squashfs(char *filename);
 extern int unsquashfs(char *squashfs, char *dest);
+extern int squashfs_lookup(char *pathname, unsigned int *start_block, unsigned int *offset, unsigned int *type);
+extern int unsquashfs_path(char *squashfs, char *dest, char *pathname);
 
 /* unsquash-1.c */
 extern void read_block_list_1(unsigned int *, char *, int);
@@ -0,0 +1,52 @@
+#ifndef UNSQUASHFS_DEDUP_H
+#    define UNSQUASHFS_DEDUP_H
+/*
+ * Duplicate file detection for unsquashfs.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * unsquashfs_dedup.h
+ */
+
+/* how files sharing their data with an already written file are output */
+#    define DEDUP_NONE	0	/* decompress and write them again */
+#    define DEDUP_CLONE	1	/* reflink (FICLONE), falling back to DEDUP_COPY */
+#    define DEDUP_COPY	2	/* copy_file_range from the first file */
+#    define DEDUP_LINK	3	/* hardlink if the attributes match, else DEDUP_CLONE */
+
+#    define DEDUP_DEFAULT DEDUP_CLONE
+
+/*
+ * A file identified by its data location: first block, size, fragment
+ * and a hash of the block list
+ */
+struct dedup_entry {
+	long long start;
+	long long file_size;
+	unsigned int fragment;
+	int offset;
+	unsigned long long list_hash;
+	char *pathname;
+	int mode;
+	uid_t uid;
+	gid_t gid;
+	time_t time;
+	unsigned int xattr;
+	struct dedup_entry *next;
+};
+
+extern int dedup_mode;
+
+extern int dedup_parse_mode(const char *name);
+extern void dedup_reset();
+extern struct dedup_entry *dedup_add(struct inode *, unsigned int *block_list, char *pathname);
+extern int write_duplicate(struct squashfs_file *);
+#endif
@@ -0,0 +1,39 @@
+#ifndef UNSQUASHFS_TAR_H
+#    define UNSQUASHFS_TAR_H
+/*
+ * Tar output for unsquashfs.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * unsquashfs_tar.h
+ */
+
+/* ustar typeflags */
+#    define TAR_REGTYPE		'0'
+#    define TAR_LNKTYPE		'1'
+#    define TAR_SYMTYPE		'2'
+#    define TAR_CHRTYPE		'3'
+#    define TAR_BLKTYPE		'4'
+#    define TAR_DIRTYPE		'5'
+#    define TAR_FIFOTYPE	'6'
+#    define TAR_XHDTYPE		'x'	/* pax extended header */
+
+#    define TAR_BLOCK_SIZE	512
+
+/* archive being written instead of extracting to disk, or -1 */
+extern int tar_fd;
+
+extern int tar_output(char *);
+extern void tar_set_root(char *);
+extern void tar_write_header(struct squashfs_file *);
+extern void tar_pad(long long);
+extern void tar_close();
+#endif
@@ -6,6 +6,15 @@
 #define __TSFILE_H
 #include <stdint.h>
 
+/*
+ * Unless disabled with config_opts.ts_index_interval, a seek index is
+ * written next to the TS file as FILE.ts.idx, one entry per line:
+ *	pcr PID PCR OFFSET	PCR (27MHz) of the packet at OFFSET, at most
+ *				one per interval (ms) and PID
+ *	rai PID OFFSET		packet with the random access indicator
+ *	pid PID packets N pes N pcr N	packet counts, for each converted part
+ * PIDs are in hex, OFFSETs are byte offsets in the TS file
+ */
 void convertSTR2TS(char *inFilename, int notOverwrite);
 void processPIF(const char *filename, char *dest_file);
 uint32_t str_crc32(const unsigned char *data, int len);
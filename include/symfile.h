@@ -29,6 +29,7 @@
  * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#    include <stddef.h>
 #    include <stdint.h>
 #    include <unistd.h>
 
@@ -38,6 +39,12 @@ struct sym_entry {
 	uint32_t sym_name_off;
 };
 
+/* A range of addresses of the symbol sym, up to the start of the next one */
+struct sym_range {
+	uint32_t start;
+	uint32_t sym;
+};
+
 struct sym_table {
 	uint32_t n_symbols;
 	struct sym_entry *sym_entry;
@@ -49,14 +56,29 @@ struct sym_table {
 	} *dwarf_lst;
 	unsigned char *dwarf_data;
 	char *sym_name;
+	/* indexes built by symfile_open() */
+	struct sym_range *ranges;
+	uint32_t n_ranges;
+	uint32_t *name_index;
+	uint32_t name_index_mask;
+};
+
+enum symfile_format {
+	SYMFILE_IDC,	/* IDA script */
+	SYMFILE_MAP,	/* "addr size name" lines */
+	SYMFILE_ELF	/* ELF object with the symbols in .symtab */
 };
 
 extern struct sym_table sym_table;
 
+int symfile_open(const char *sym_fname, struct sym_table *table);
 int symfile_load(const char *sym_fname);
 uint32_t symfile_addr_by_name(const char *name);
 const char *symfile_name_by_addr(uint32_t addr);
+/* Names of the symbols at count addresses, NULL for the unknown ones */
+void symfile_names_by_addr(const uint32_t *addrs, const char **names, size_t count);
 uint32_t symfile_n_symbols();
 void symfile_write_idc(const char *fname);
+int symfile_export(const struct sym_table *table, const char *fname, enum symfile_format format);
 
 #endif
@@ -0,0 +1,41 @@
+/*
+	CRC32 checksums
+*/
+#ifndef __UTIL_CRC32_H
+#define __UTIL_CRC32_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Reflected CRC-32 (0xEDB88320), as used by zlib, JFFS2 and Ethernet.
+ * crc is the raw register: no inversion is done on input or output, so
+ * this is JFFS2's crc32(0, ...) and zlib's crc32() is
+ * ~crc32_update(~crc, ...).
+ *
+ * The fastest implementation the CPU supports (PCLMULQDQ or the ARMv8
+ * CRC32 instructions, slicing-by-16 otherwise) is selected at startup.
+ */
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
+
+/* CRC-32 of buf with the usual inversion, as zlib's crc32(0, buf, len) */
+uint32_t crc32_ieee(const void *buf, size_t len);
+
+/*
+ * Non-reflected CRC-32 (0x04C11DB7) without inversion, as used by MPEG-2
+ * sections when started from 0xFFFFFFFF
+ */
+uint32_t crc32_be_update(uint32_t crc, const void *buf, size_t len);
+
+/* Name of the selected crc32_update implementation */
+const char *crc32_impl(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
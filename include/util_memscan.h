@@ -0,0 +1,34 @@
+/*
+	Vectorized scanning of large images
+*/
+#ifndef __UTIL_MEMSCAN_H
+#define __UTIL_MEMSCAN_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Length of the run of bytes equal to c at the start of buf */
+size_t memspan(const void *buf, size_t len, uint8_t c);
+
+/*
+ * Offset of the first 16-bit word at a multiple of 4 from buf that is
+ * magic, in either byte order, or len if there's none
+ */
+size_t memfind_magic16(const void *buf, size_t len, uint16_t magic);
+
+/*
+ * Offset of the first byte equal to c that is followed by count - 1 more,
+ * stride bytes apart, all within buf (e.g. the 0x47 sync bytes of 188, 192
+ * or 204 byte transport stream packets), or len if there's none
+ */
+size_t memfind_sync(const void *buf, size_t len, uint8_t c, size_t stride, int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,416 @@
+/**
+ * Deferred file attributes
+ *
+ * Extractors record the attributes of every entry while writing the tree,
+ * and apply them all at the end in a parallel pass working on directory
+ * file descriptors rather than full paths.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef __linux__
+#    include <sys/xattr.h>
+#endif
+
+#include "attr_sink.h"
+#include "thpool.h"
+
+#define ATTR_DIRS_INITIAL 256
+#define ATTR_ENTRIES_INITIAL 1024
+#define ATTR_CHUNK_MIN 64
+#define ATTR_ERRORS_MAX 10
+
+struct attr_xattr {
+	char *name;
+	void *value;
+	size_t size;
+	struct attr_xattr *next;
+};
+
+struct attr_entry {
+	int dir;		/* index of the parent directory */
+	int depth;		/* number of path components, for directories */
+	char *name;		/* name inside the parent directory */
+	int flags;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	time_t mtime;
+	struct attr_xattr *xattrs;
+};
+
+struct attr_dir {
+	char *path;
+	int next;		/* next directory in the same hash bucket */
+};
+
+struct attr_sink {
+	pthread_mutex_t lock;
+
+	struct attr_entry *entries;
+	int count, size;
+
+	struct attr_dir *dirs;
+	int dir_count, dir_size;
+	int *dir_table;		/* hash buckets of directory indices, power of two sized */
+
+	int errors;
+	int no_xattrs;
+};
+
+struct attr_work {
+	struct attr_sink *sink;
+	int start, end;
+};
+
+struct attr_sink *attr_sink_new(void) {
+	struct attr_sink *sink = calloc(1, sizeof(struct attr_sink));
+
+	if (sink == NULL)
+		return NULL;
+
+	pthread_mutex_init(&sink->lock, NULL);
+	return sink;
+}
+
+static unsigned int attr_hash(const char *str, size_t len) {
+	/* FNV-1a */
+	unsigned int hash = 2166136261u;
+
+	while (len--) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static int attr_grow_dirs(struct attr_sink *sink) {
+	int new_size = sink->dir_size ? sink->dir_size * 2 : ATTR_DIRS_INITIAL, i;
+	struct attr_dir *dirs = realloc(sink->dirs, new_size * sizeof(struct attr_dir));
+	int *table;
+
+	if (dirs == NULL)
+		return -1;
+	sink->dirs = dirs;
+
+	table = malloc(new_size * sizeof(int));
+	if (table == NULL)
+		return -1;
+
+	memset(table, -1, new_size * sizeof(int));
+	for (i = 0; i < sink->dir_count; i++) {
+		unsigned int hash = attr_hash(dirs[i].path, strlen(dirs[i].path)) & (new_size - 1);
+
+		dirs[i].next = table[hash];
+		table[hash] = i;
+	}
+
+	free(sink->dir_table);
+	sink->dir_table = table;
+	sink->dir_size = new_size;
+	return 0;
+}
+
+/* Returns the index of the directory path[0..len), registering it if needed */
+static int attr_get_dir(struct attr_sink *sink, const char *path, size_t len) {
+	unsigned int hash;
+	int i;
+
+	if (sink->dir_count >= sink->dir_size && attr_grow_dirs(sink) < 0)
+		return -1;
+
+	hash = attr_hash(path, len) & (sink->dir_size - 1);
+	for (i = sink->dir_table[hash]; i != -1; i = sink->dirs[i].next) {
+		if (strncmp(sink->dirs[i].path, path, len) == 0 && sink->dirs[i].path[len] == '\0')
+			return i;
+	}
+
+	i = sink->dir_count;
+	sink->dirs[i].path = strndup(path, len);
+	if (sink->dirs[i].path == NULL)
+		return -1;
+
+	sink->dirs[i].next = sink->dir_table[hash];
+	sink->dir_table[hash] = i;
+	sink->dir_count++;
+	return i;
+}
+
+int attr_sink_add(struct attr_sink *sink, const char *path, int flags, mode_t mode, uid_t uid, gid_t gid, time_t mtime) {
+	size_t len = strlen(path);
+	const char *name, *slash;
+	struct attr_entry *entry;
+	int dir, depth = 0, i = -1;
+
+	/* split into parent directory and name, ignoring trailing slashes */
+	while (len > 1 && path[len - 1] == '/')
+		len--;
+
+	slash = memrchr(path, '/', len);
+	if (slash == NULL)
+		name = path;
+	else if (slash == path && len == 1)
+		return -1;
+	else
+		name = slash + 1;
+
+	for (slash = path; slash < name; slash++)
+		depth += *slash == '/';
+
+	pthread_mutex_lock(&sink->lock);
+
+	if (name == path)
+		dir = attr_get_dir(sink, ".", 1);
+	else if (name == path + 1)
+		dir = attr_get_dir(sink, "/", 1);
+	else
+		dir = attr_get_dir(sink, path, name - path - 1);
+	if (dir < 0)
+		goto out;
+
+	if (sink->count >= sink->size) {
+		int new_size = sink->size ? sink->size * 2 : ATTR_ENTRIES_INITIAL;
+		struct attr_entry *entries = realloc(sink->entries, new_size * sizeof(struct attr_entry));
+
+		if (entries == NULL)
+			goto out;
+		sink->entries = entries;
+		sink->size = new_size;
+	}
+
+	entry = &sink->entries[sink->count];
+	entry->name = strndup(name, len - (name - path));
+	if (entry->name == NULL)
+		goto out;
+
+	entry->dir = dir;
+	entry->depth = depth;
+	entry->flags = flags;
+	entry->mode = mode;
+	entry->uid = uid;
+	entry->gid = gid;
+	entry->mtime = mtime;
+	entry->xattrs = NULL;
+	i = sink->count++;
+
+ out:
+	pthread_mutex_unlock(&sink->lock);
+	if (i < 0)
+		fprintf(stderr, "Out of memory recording the attributes of '%s'\n", path);
+	return i;
+}
+
+int attr_sink_xattr(struct attr_sink *sink, int entry, const char *name, const void *value, size_t size) {
+	struct attr_xattr *xattr;
+
+	if (entry < 0)
+		return -1;
+
+	xattr = malloc(sizeof(struct attr_xattr));
+	if (xattr == NULL)
+		return -1;
+
+	xattr->name = strdup(name);
+	xattr->value = malloc(size ? size : 1);
+	if (xattr->name == NULL || xattr->value == NULL) {
+		free(xattr->name);
+		free(xattr->value);
+		free(xattr);
+		return -1;
+	}
+	memcpy(xattr->value, value, size);
+	xattr->size = size;
+
+	pthread_mutex_lock(&sink->lock);
+	xattr->next = sink->entries[entry].xattrs;
+	sink->entries[entry].xattrs = xattr;
+	pthread_mutex_unlock(&sink->lock);
+	return 0;
+}
+
+static void attr_error(struct attr_sink *sink, const char *what, struct attr_entry *entry, int err) {
+	int n = __sync_fetch_and_add(&sink->errors, 1);
+
+	if (n < ATTR_ERRORS_MAX)
+		fprintf(stderr, "%s failed for '%s/%s' (%s)\n", what, sink->dirs[entry->dir].path, entry->name, strerror(err));
+	else if (n == ATTR_ERRORS_MAX)
+		fprintf(stderr, "%d attribute errors printed, further ones are suppressed\n", ATTR_ERRORS_MAX);
+}
+
+static void attr_apply_xattrs(struct attr_sink *sink, struct attr_entry *entry) {
+#ifdef __linux__
+	struct attr_xattr *xattr;
+	char path[PATH_MAX];
+
+	/* there is no *at() variant of lsetxattr */
+	snprintf(path, sizeof(path), "%s/%s", sink->dirs[entry->dir].path, entry->name);
+
+	for (xattr = entry->xattrs; xattr && !sink->no_xattrs; xattr = xattr->next) {
+		if (lsetxattr(path, xattr->name, xattr->value, xattr->size, 0) == 0)
+			continue;
+
+		if (errno == ENOTSUP) {
+			/* unlikely to go away, don't print the same error for every file */
+			if (!__sync_lock_test_and_set(&sink->no_xattrs, 1))
+				fprintf(stderr, "Extended attributes are not supported by the destination filesystem, ignoring them\n");
+		} else
+			attr_error(sink, "lsetxattr", entry, errno);
+	}
+#endif
+}
+
+static void attr_apply_entry(struct attr_sink *sink, int dirfd, struct attr_entry *entry) {
+	int nofollow = S_ISLNK(entry->mode) ? AT_SYMLINK_NOFOLLOW : 0;
+
+	/*
+	 * chown first: it clears setuid bits and file capabilities, so
+	 * the mode and xattrs must come after it.  The mode after the
+	 * xattrs, as writing them needs write permission for a non root
+	 * user.
+	 */
+	if ((entry->flags & ATTR_OWNER) && fchownat(dirfd, entry->name, entry->uid, entry->gid, nofollow) == -1)
+		attr_error(sink, "chown", entry, errno);
+
+	if (entry->xattrs)
+		attr_apply_xattrs(sink, entry);
+
+	if ((entry->flags & ATTR_MODE) && !nofollow && fchmodat(dirfd, entry->name, entry->mode & 07777, 0) == -1)
+		attr_error(sink, "chmod", entry, errno);
+
+	if (entry->flags & ATTR_TIME) {
+		struct timespec times[2] = {
+			{.tv_sec = entry->mtime},
+			{.tv_sec = entry->mtime}
+		};
+
+		if (utimensat(dirfd, entry->name, times, nofollow) == -1)
+			attr_error(sink, "utime", entry, errno);
+	}
+}
+
+static void attr_apply_range(struct attr_work *work) {
+	struct attr_sink *sink = work->sink;
+	int dirfd = -1, dir = -1, i;
+
+	for (i = work->start; i < work->end; i++) {
+		struct attr_entry *entry = &sink->entries[i];
+
+		/* entries are sorted by directory, open each one once */
+		if (entry->dir != dir) {
+			if (dirfd != -1)
+				close(dirfd);
+			dir = entry->dir;
+			dirfd = open(sink->dirs[dir].path, O_RDONLY | O_DIRECTORY);
+			if (dirfd == -1)
+				attr_error(sink, "open", entry, errno);
+		}
+
+		if (dirfd != -1)
+			attr_apply_entry(sink, dirfd, entry);
+	}
+
+	if (dirfd != -1)
+		close(dirfd);
+}
+
+static int attr_compare(const void *a, const void *b) {
+	const struct attr_entry *ea = a, *eb = b;
+	int dir_a = S_ISDIR(ea->mode), dir_b = S_ISDIR(eb->mode);
+
+	/* everything else before directories, directories deepest first */
+	if (dir_a != dir_b)
+		return dir_a - dir_b;
+	if (dir_a && ea->depth != eb->depth)
+		return eb->depth - ea->depth;
+	return ea->dir - eb->dir;
+}
+
+static int attr_same_level(struct attr_entry *a, struct attr_entry *b) {
+	if (S_ISDIR(a->mode) != S_ISDIR(b->mode))
+		return 0;
+	return !S_ISDIR(a->mode) || a->depth == b->depth;
+}
+
+int attr_sink_apply(struct attr_sink *sink, int nThreads) {
+	threadpool thpool;
+	struct attr_work *work;
+	int start, end;
+
+	if (sink->count == 0)
+		return 0;
+
+	qsort(sink->entries, sink->count, sizeof(struct attr_entry), attr_compare);
+
+	if (nThreads < 1)
+		nThreads = 1;
+
+	work = malloc(nThreads * 4 * sizeof(struct attr_work));
+	if (work == NULL) {
+		fprintf(stderr, "Out of memory applying file attributes\n");
+		return sink->count;
+	}
+
+	thpool = thpool_init(nThreads);
+
+	/*
+	 * A level (all the non directories, or the directories at one
+	 * depth) has to be complete before the next one can start
+	 */
+	for (start = 0; start < sink->count; start = end) {
+		int chunk, nwork = 0, i;
+
+		for (end = start + 1; end < sink->count && attr_same_level(&sink->entries[start], &sink->entries[end]); end++) ;
+
+		chunk = (end - start + nThreads * 4 - 1) / (nThreads * 4);
+		if (chunk < ATTR_CHUNK_MIN)
+			chunk = ATTR_CHUNK_MIN;
+
+		for (i = start; i < end; i += chunk, nwork++) {
+			work[nwork].sink = sink;
+			work[nwork].start = i;
+			work[nwork].end = (i + chunk < end) ? i + chunk : end;
+			thpool_add_work(thpool, (void *)attr_apply_range, &work[nwork]);
+		}
+		thpool_wait(thpool);
+	}
+
+	thpool_destroy(thpool);
+	free(work);
+
+	return sink->errors;
+}
+
+void attr_sink_free(struct attr_sink *sink) {
+	int i;
+
+	if (sink == NULL)
+		return;
+
+	for (i = 0; i < sink->count; i++) {
+		struct attr_xattr *xattr = sink->entries[i].xattrs, *next;
+
+		for (; xattr; xattr = next) {
+			next = xattr->next;
+			free(xattr->name);
+			free(xattr->value);
+			free(xattr);
+		}
+		free(sink->entries[i].name);
+	}
+
+	for (i = 0; i < sink->dir_count; i++)
+		free(sink->dirs[i].path);
+
+	free(sink->entries);
+	free(sink->dirs);
+	free(sink->dir_table);
+	pthread_mutex_destroy(&sink->lock);
+	free(sink);
+}
@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
 // Unix things
 #include <unistd.h>
@@ -29,6 +30,9 @@
 // Cramfs definitions
 #include "cramfs.h"
 
+#include "attr_sink.h"
+#include "thpool.h"
+
 #include "os_byteswap.h"
 
 #define PAGE_CACHE_SIZE (4096)
@@ -41,16 +45,87 @@ static char *opt_idsfile = NULL;
 
 static int DIR_GID = 0;
 
+// Ownership and modes, applied once the whole tree is extracted
+static struct attr_sink *attrs = NULL;
+
+// End of the mapped image, block pointers past it are corrupt
+static const u8 *image_end = NULL;
+
+// Workers uncompressing the blocks of large files
+static threadpool pool = NULL;
+
+// Files with fewer blocks are uncompressed by the caller
+#define PARALLEL_MIN_BLOCKS	32
+#define BLOCKS_PER_TASK		16
+
 void do_file_entry(const u8 * base, const char *dir, const char *path, const char *name, int namelen, const struct cramfs_inode *inode);
 
 void do_dir_entry(const u8 * base, const char *dir, const char *path, const char *name, int namelen, const struct cramfs_inode *inode);
 
 ///////////////////////////////////////////////////////////////////////////////
 
+/*
+ * Big endian images are read in place. Their inodes have the bitfields
+ * laid out from the most significant bit, and their block pointers are
+ * big endian too, except for XIP images whose data was left little endian
+ */
+static int inode_be = 0;
+static int data_be = 0;
+
+// An inode in host byte order
+struct cramfs_entry {
+	u32 mode, uid;
+	u32 size, gid;
+	u32 namelen, offset;
+};
+
+static inline u32 get32_le(const u8 * p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+static inline u32 get32_be(const u8 * p) {
+	return ((u32)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void cramfs_entry_le(const u8 * p, struct cramfs_entry *e) {
+	u32 w0 = get32_le(p), w1 = get32_le(p + 4), w2 = get32_le(p + 8);
+
+	e->mode = w0 & 0xffff;
+	e->uid = w0 >> 16;
+	e->size = w1 & 0xffffff;
+	e->gid = w1 >> 24;
+	e->namelen = w2 & 0x3f;
+	e->offset = w2 >> 6;
+}
+
+static inline void cramfs_entry_be(const u8 * p, struct cramfs_entry *e) {
+	u32 w0 = get32_be(p), w1 = get32_be(p + 4), w2 = get32_be(p + 8);
+
+	e->mode = w0 >> 16;
+	e->uid = w0 & 0xffff;
+	e->size = w1 >> 8;
+	e->gid = w1 & 0xff;
+	e->namelen = w2 >> 26;
+	e->offset = w2 & 0x3ffffff;
+}
+
+static inline void read_entry(const struct cramfs_inode *inode, struct cramfs_entry *e) {
+	if (inode_be)
+		cramfs_entry_be((const u8 *)inode, e);
+	else
+		cramfs_entry_le((const u8 *)inode, e);
+}
+
+// Block pointer i of a file
+static inline u32 block_ptr(const u8 * data, int i) {
+	return data_be ? get32_be(data + i * 4) : get32_le(data + i * 4);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
 u32 compressed_size(const u8 * base, const u8 * data, u32 size) {
-	const u32 *buffs = (const u32 *)(data);
 	int nblocks = (size - 1) / blksize + 1;
-	const u8 *buffend = base + *(buffs + nblocks - 1);
+	const u8 *buffend = base + block_ptr(data, nblocks - 1);
 
 	if (size == 0)
 		return 0;
@@ -58,26 +133,289 @@ u32 compressed_size(const u8 * base, const u8 * data, u32 size) {
 		return buffend - data;
 }
 
-void uncompress_data(const u8 * base, const u8 * data, u32 size, u8 * dstdata) {
-	const u32 *buffs = (const u32 *)(data);
+// One inflate context per thread, reset for every block
+static pthread_key_t inflate_key;
+static pthread_once_t inflate_once = PTHREAD_ONCE_INIT;
+
+static void inflate_free(void *arg) {
+	z_stream *strm = arg;
+
+	inflateEnd(strm);
+	free(strm);
+}
+
+static void inflate_key_init(void) {
+	pthread_key_create(&inflate_key, inflate_free);
+}
+
+static z_stream *inflate_get(void) {
+	z_stream *strm;
+
+	pthread_once(&inflate_once, inflate_key_init);
+	strm = pthread_getspecific(inflate_key);
+	if (strm == NULL) {
+		strm = calloc(1, sizeof(z_stream));
+		if (strm == NULL)
+			return NULL;
+		if (inflateInit(strm) != Z_OK) {
+			free(strm);
+			return NULL;
+		}
+		pthread_setspecific(inflate_key, strm);
+	}
+	return strm;
+}
+
+/*
+ * Uncompresses blocks [first, last) of a file into their page of dstdata.
+ * Returns 0, or -1 if a block failed
+ */
+static int uncompress_blocks(const u8 * base, const u8 * data, u32 size, int first, int last, u8 * dstdata) {
 	int nblocks = (size - 1) / blksize + 1;
-	const u8 *buff = (const u8 *)(buffs + nblocks);
-	const u8 *nbuff;
-	int block = 0;
-	uLongf len = size;
+	z_stream *strm = inflate_get();
+	int block;
+
+	if (strm == NULL || data + nblocks * 4 > image_end)
+		return -1;
+
+	for (block = first; block < last; ++block) {
+		const u8 *buff = (block == 0) ? data + nblocks * 4 : base + block_ptr(data, block - 1);
+		const u8 *nbuff = base + block_ptr(data, block);
+		u32 tran = (size - block * blksize < blksize) ? size - block * blksize : blksize;
+
+		if (nbuff < buff || nbuff > image_end)
+			return -1;
+
+		// an empty block is a hole, already zero
+		if (nbuff == buff)
+			continue;
+
+		if (inflateReset(strm) != Z_OK)
+			return -1;
+		strm->next_in = (u8 *)buff;
+		strm->avail_in = nbuff - buff;
+		strm->next_out = dstdata + block * blksize;
+		strm->avail_out = tran;
+		if (inflate(strm, Z_FINISH) != Z_STREAM_END)
+			return -1;
+	}
+	return 0;
+}
+
+void uncompress_data(const u8 * base, const u8 * data, u32 size, u8 * dstdata) {
+	if (size == 0) {
+		return;
+	}
+
+	if (uncompress_blocks(base, data, size, 0, (size - 1) / blksize + 1, dstdata))
+		fprintf(stderr, "Uncompression failed");
+}
+
+/*
+ * A large file mapped for its block tasks, the last one to finish unmaps
+ * it. The descriptor is closed once the file is mapped, so that files
+ * waiting for their blocks don't hold one
+ */
+struct file_map {
+	u8 *data;
+	u32 size;
+	int pending;
+	int failed;
+	pthread_mutex_t lock;
+};
+
+struct block_work {
+	const u8 *base;
+	const u8 *data;
+	int first, last;
+	struct file_map *map;
+};
+
+static void file_map_put(struct file_map *map, int failed) {
+	int last;
+
+	pthread_mutex_lock(&map->lock);
+	map->failed |= failed;
+	last = (--map->pending == 0);
+	pthread_mutex_unlock(&map->lock);
+
+	if (!last)
+		return;
+
+	if (map->failed)
+		fprintf(stderr, "Uncompression failed");
+	munmap(map->data, map->size);
+	pthread_mutex_destroy(&map->lock);
+	free(map);
+}
+
+static void uncompress_work(struct block_work *work) {
+	file_map_put(work->map, uncompress_blocks(work->base, work->data, work->map->size, work->first, work->last, work->map->data));
+	free(work);
+}
+
+// Creates name in dirfd and uncompresses the file at offset into it
+static void extract_file(const u8 * base, int dirfd, const char *name, u32 offset, u32 size, int mode) {
+	struct file_map *map;
+	u8 *file_data;
+	int fd, nblocks, first;
+
+	fd = openat(dirfd, name, O_CREAT | O_TRUNC | O_RDWR, mode);
+	if (fd == -1) {
+		perror("create");
+		return;
+	};
+
+	if (ftruncate(fd, size) == -1) {
+		perror("ftruncate");
+		close(fd);
+		return;
+	}
 
 	if (size == 0) {
+		close(fd);
+		return;
+	}
+
+	file_data = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (file_data == MAP_FAILED) {
+		perror("mmap");
+		return;
+	}
+
+	// Allow for uncompressed XIP executable
+	if (mode & S_ISVTX) {
+		// It seems that the offset may not necessarily be page
+		// aligned. This is silly because mkcramfs wastes
+		// the alignment space, whereas it might be used if it wasn't
+		// bogusly in our file extent.
+		//
+		// blksize must be a power of 2 for the following to work, but it seems
+		// quite likely.
+		const u8 *srcdata = (const u8 *)(((long)(base + offset) + blksize - 1) & ~(blksize - 1));
+
+		memcpy(file_data, srcdata, size);
+		munmap(file_data, size);
+		return;
+	}
+
+	nblocks = (size - 1) / blksize + 1;
+	if (nblocks < PARALLEL_MIN_BLOCKS) {
+		uncompress_data(base, base + offset, size, file_data);
+		munmap(file_data, size);
 		return;
 	}
 
-	for (; block < nblocks; ++block, buff = nbuff, dstdata += blksize, len -= blksize) {
-		uLongf tran = (len < blksize) ? len : blksize;
-		nbuff = base + *(buffs + block);
-		if (uncompress(dstdata, &tran, buff, nbuff - buff) != Z_OK) {
-			fprintf(stderr, "Uncompression failed");
+	// blocks are independent, large files are split across the pool
+	map = calloc(1, sizeof(struct file_map));
+	if (map == NULL) {
+		uncompress_data(base, base + offset, size, file_data);
+		munmap(file_data, size);
+		return;
+	}
+	map->data = file_data;
+	map->size = size;
+	map->pending = 1;
+	pthread_mutex_init(&map->lock, NULL);
+
+	for (first = 0; first < nblocks; first += BLOCKS_PER_TASK) {
+		struct block_work *work = malloc(sizeof(struct block_work));
+		int last = (first + BLOCKS_PER_TASK < nblocks) ? first + BLOCKS_PER_TASK : nblocks;
+
+		if (work == NULL) {
+			file_map_put(map, uncompress_blocks(base, base + offset, size, first, last, file_data));
+			continue;
+		}
+
+		work->base = base;
+		work->data = base + offset;
+		work->first = first;
+		work->last = last;
+		work->map = map;
+
+		pthread_mutex_lock(&map->lock);
+		map->pending++;
+		pthread_mutex_unlock(&map->lock);
+		thpool_add_work(pool, (void *)uncompress_work, work);
+	}
+
+	file_map_put(map, 0);
+}
+
+/*
+ * Regular files of a directory, handed to the pool while the walk goes
+ * on. The task opens the directory again and creates its files relative
+ * to it, so that no descriptor is held while it waits in the queue
+ */
+#define FILES_PER_TASK 64
+
+struct file_entry {
+	char *name;
+	u32 offset, size;
+	int mode;
+};
+
+struct file_batch {
+	const u8 *base;
+	char *dir;
+	int count;
+	struct file_entry files[FILES_PER_TASK];
+};
+
+static struct file_batch *batch = NULL;
+
+static void write_files(struct file_batch *work) {
+	int dirfd = open(work->dir, O_RDONLY | O_DIRECTORY), i;
+
+	if (dirfd == -1)
+		perror(work->dir);
+
+	for (i = 0; i < work->count; i++) {
+		if (dirfd != -1)
+			extract_file(work->base, dirfd, work->files[i].name, work->files[i].offset, work->files[i].size, work->files[i].mode);
+		free(work->files[i].name);
+	}
+
+	if (dirfd != -1)
+		close(dirfd);
+	free(work->dir);
+	free(work);
+}
+
+static void flush_files(void) {
+	if (batch) {
+		thpool_add_work(pool, (void *)write_files, batch);
+		batch = NULL;
+	}
+}
+
+// Queues the file at path, name being its last component
+static void queue_file(const u8 * base, const char *path, const char *name, u32 offset, u32 size, int mode) {
+	int dirlen = name - path;
+	struct file_entry *file;
+
+	if (batch && (strncmp(batch->dir, path, dirlen) != 0 || batch->dir[dirlen] != '\0'))
+		flush_files();
+
+	if (batch == NULL) {
+		batch = calloc(1, sizeof(struct file_batch));
+		if (batch == NULL) {
+			perror("queue_file");
 			return;
 		}
+		batch->base = base;
+		batch->dir = dirlen ? strndup(path, dirlen) : strdup(".");
 	}
+
+	file = &batch->files[batch->count++];
+	file->name = strdup(name);
+	file->offset = offset;
+	file->size = size;
+	file->mode = mode;
+
+	if (batch->count == FILES_PER_TASK)
+		flush_files();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -120,7 +458,7 @@ void printstats() {
 
 ///////////////////////////////////////////////////////////////////////////////
 
-void printmode(const struct cramfs_inode *inode) {
+void printmode(const struct cramfs_entry *inode) {
 	u16 mode = inode->mode;
 
 	// Deal with file type bitsetc
@@ -193,7 +531,7 @@ void printmode(const struct cramfs_inode *inode) {
 		printf("-");
 }
 
-void printuidgid(const struct cramfs_inode *inode) {
+void printuidgid(const struct cramfs_entry *inode) {
 	char res[14];
 
 	snprintf(res, 14, "%d/%d", inode->uid, inode->gid);
@@ -214,62 +552,16 @@ void printsize(int size, int csize) {
 ///////////////////////////////////////////////////////////////////////////////
 
 void do_file(const u8 * base, u32 offset, u32 size, const char *path, const char *name, int mode) {
-	int fd;
-	u8 *file_data;
-	const u8 *srcdata;
-
-	// Allow for uncompressed XIP executable
-	if (mode & S_ISVTX) {
-		// It seems that the offset may not necessarily be page
-		// aligned. This is silly because mkcramfs wastes
-		// the alignment space, whereas it might be used if it wasn't
-		// bogusly in our file extent.
-		//
-		// blksize must be a power of 2 for the following to work, but it seems
-		// quite likely.
-
-		srcdata = (const u8 *)(((long)(base + offset) + blksize - 1) & ~(blksize - 1));
-
-		//printsize(size, srcdata + size - (base + offset));
-		//printf("%s", name);
-	} else {
-		//printsize(size, compressed_size(base, base + offset, size));
-		//printf("%s", name);
-	}
+	//printsize(size, compressed_size(base, base + offset, size));
+	//printf("%s", name);
 
 	// Check if we are actually unpacking
 	if (path[0] == '-') {
 		return;
 	}
-	// Make local copy
-	fd = open(path, O_CREAT | O_TRUNC | O_RDWR, mode);
-	if (fd == -1) {
-		perror("create");
-		return;
-	};
-
-	if (ftruncate(fd, size) == -1) {
-		perror("ftruncate");
-		close(fd);
-		return;
-	}
-
-	file_data = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (file_data == MAP_FAILED) {
-		perror("mmap");
-		close(fd);
-		return;
-	}
-	// Allow for uncompressed XIP executable
-	if (mode & S_ISVTX) {
-		memcpy(file_data, srcdata, size);
-	} else {
-		uncompress_data(base, base + offset, size, file_data);
-	}
-
-	munmap(file_data, size);
-	close(fd);
 
+	// Written by the pool, the directory exists by now
+	queue_file(base, path, name, offset, size, mode);
 }
 
 void do_directory(const u8 * base, u32 offset, u32 size, const char *path, const char *name, int mode) {
@@ -280,8 +572,8 @@ void do_directory(const u8 * base, u32 offset, u32 size, const char *path, const
 	if (path[0] == '-') {
 		return;
 	}
-	// Make the local directory
-	if (mkdir(path, mode) == -1) {
+	// Make the local directory, writable until its final mode is applied
+	if (mkdir(path, mode | S_IRWXU) == -1) {
 		perror(path);
 		return;
 	}
@@ -431,6 +723,7 @@ void do_unknown(const u8 * base, u32 offset, u32 size, const char *path, const c
 
 void process_directory(const u8 * base, const char *dir, u32 offset, u32 size, const char *path) {
 	struct cramfs_inode *de;
+	struct cramfs_entry e;
 	char *name;
 	int namelen;
 	u32 current = offset;
@@ -441,7 +734,8 @@ void process_directory(const u8 * base, const char *dir, u32 offset, u32 size, c
 		u32 nextoffset;
 
 		de = (struct cramfs_inode *)(base + current);
-		namelen = de->namelen << 2;
+		read_entry(de, &e);
+		namelen = e.namelen << 2;
 		nextoffset = current + sizeof(struct cramfs_inode) + namelen;
 
 		name = (char *)(de + 1);
@@ -458,6 +752,7 @@ void process_directory(const u8 * base, const char *dir, u32 offset, u32 size, c
 
 		current = nextoffset;
 	}
+	flush_files();
 
 	// Recurse into directories
 	current = offset;
@@ -465,7 +760,8 @@ void process_directory(const u8 * base, const char *dir, u32 offset, u32 size, c
 		u32 nextoffset;
 
 		de = (struct cramfs_inode *)(base + current);
-		namelen = de->namelen << 2;
+		read_entry(de, &e);
+		namelen = e.namelen << 2;
 		nextoffset = current + sizeof(struct cramfs_inode) + namelen;
 
 		name = (char *)(de + 1);
@@ -486,12 +782,16 @@ void process_directory(const u8 * base, const char *dir, u32 offset, u32 size, c
 
 ///////////////////////////////////////////////////////////////////////////////
 
-void do_file_entry(const u8 * base, const char *dir, const char *path, const char *name, int namelen, const struct cramfs_inode *inode) {
+void do_file_entry(const u8 * base, const char *dir, const char *path, const char *name, int namelen, const struct cramfs_inode *raw) {
+	struct cramfs_entry e, *inode = &e;
 	int dirlen = strlen(dir);
 	int pathlen = strlen(path);
 	char pname[dirlen + pathlen + namelen + 3];
 	const char *basename;
-	u32 gid = inode->gid;
+	u32 gid;
+
+	read_entry(raw, inode);
+	gid = inode->gid;
 
 	if (dirlen) {
 		strncpy(pname, dir, dirlen);
@@ -553,10 +853,21 @@ void do_file_entry(const u8 * base, const char *dir, const char *path, const cha
 		do_unknown(base, inode->offset << 2, inode->size, pname, basename, inode->mode);
 	}
 
-	if (geteuid() == 0) {
-		if (lchown(pname, inode->uid, gid) == -1)
-			perror("cannot change owner or group");
-	} else if (opt_idsfile && path && path[0]) {
+	if (pname[0] != '-') {
+		int flags = 0;
+
+		if (geteuid() == 0)
+			flags |= ATTR_OWNER;
+		if (S_ISDIR(inode->mode))
+			flags |= ATTR_MODE;
+		else if ((geteuid() == 0 || !opt_idsfile) && (inode->mode & (S_ISGID | S_ISUID | S_ISVTX)))
+			flags |= ATTR_MODE;
+
+		if (flags)
+			attr_sink_add(attrs, pname, flags, inode->mode, inode->uid, gid, 0);
+	}
+
+	if (geteuid() != 0 && opt_idsfile && path && path[0]) {
 		char dfp[1024];
 		char *p;
 		FILE *f;
@@ -576,22 +887,16 @@ void do_file_entry(const u8 * base, const char *dir, const char *path, const cha
 		fprintf(f, "%s,%u,%u,%08x\n", basename, inode->uid, inode->gid, inode->mode);
 		fclose(f);
 	}
-
-	if (geteuid() == 0 || !opt_idsfile) {
-		if (inode->mode & (S_ISGID | S_ISUID | S_ISVTX)) {
-			if (0 != chmod(pname, inode->mode)) {
-				perror("chmod");
-				return;
-			}
-		}
-	}
 	//printf("\n");
 }
 
-void do_dir_entry(const u8 * base, const char *dir, const char *path, const char *name, int namelen, const struct cramfs_inode *inode) {
+void do_dir_entry(const u8 * base, const char *dir, const char *path, const char *name, int namelen, const struct cramfs_inode *raw) {
+	struct cramfs_entry e, *inode = &e;
 	int pathlen = strlen(path);
 	char pname[pathlen + namelen + 2];
 
+	read_entry(raw, inode);
+
 	if (pathlen) {
 		strncpy(pname, path, pathlen);
 	}
@@ -680,19 +985,40 @@ int uncramfs(char const *dirname, char const *imagefile) {
 	}
 
 	sb = (struct cramfs_super const *)(rom_image);
-	// Check cramfs magic number and signature
-	if (CRAMFS_MAGIC != sb->magic || 0 != memcmp(sb->signature, CRAMFS_SIGNATURE, sizeof(sb->signature))) {
+	// Check cramfs magic number and signature, in either byte order
+	if (get32_le(rom_image) == CRAMFS_MAGIC) {
+		inode_be = data_be = 0;
+	} else if (get32_be(rom_image) == CRAMFS_MAGIC) {
+		// fsid.blocks is 0 for XIP images, which have little endian data
+		inode_be = 1;
+		data_be = (get32_be(sb->fsid + 8) != 0);
+	} else {
 		fprintf(stderr, "The image file doesn't have cramfs signatures\n");
 		exit(1);
 	}
+	if (0 != memcmp(sb->signature, CRAMFS_SIGNATURE, sizeof(sb->signature))) {
+		fprintf(stderr, "The image file doesn't have cramfs signatures\n");
+		exit(1);
+	}
+	image_end = rom_image + fslen_ub;
+
 	// Set umask to 0 to let the image modes shine through
 	umask(0);
 
 	clearstats();
 
 	// Start doing...
+	attrs = attr_sink_new();
+	pool = thpool_init(sysconf(_SC_NPROCESSORS_ONLN));
 	do_file_entry(rom_image, dirname, "", "", 0, &sb->root);
 	do_dir_entry(rom_image, dirname, "", "", 0, &sb->root);
+	flush_files();
+	thpool_wait(pool);
+	thpool_destroy(pool);
+	pool = NULL;
+	attr_sink_apply(attrs, sysconf(_SC_NPROCESSORS_ONLN));
+	attr_sink_free(attrs);
+	attrs = NULL;
 
 	return 0;
 }
@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include "crc.h"
+#include "util_crc32.h"
 
 #ifdef __TURBOC__
 #    pragma warn -cln
@@ -120,8 +121,9 @@ DWORD updateCRC32(unsigned char ch, DWORD crc) {
 
 Boolean_T crc32file(char *name, DWORD * crc, long *charcnt) {
 	FILE *fin;
-	DWORD oldcrc32;
-	int c;
+	uint32_t oldcrc32;
+	unsigned char buf[65536];
+	size_t n;
 
 	oldcrc32 = 0xFFFFFFFF;
 	*charcnt = 0;
@@ -134,9 +136,9 @@ Boolean_T crc32file(char *name, DWORD * crc, long *charcnt) {
 		perror(name);
 		return Error_;
 	}
-	while ((c = getc(fin)) != EOF) {
-		++*charcnt;
-		oldcrc32 = UPDC32(c, oldcrc32);
+	while ((n = fread(buf, 1, sizeof(buf), fin)) > 0) {
+		*charcnt += n;
+		oldcrc32 = crc32_update(oldcrc32, buf, n);
 	}
 
 	if (ferror(fin)) {
@@ -151,16 +153,7 @@ Boolean_T crc32file(char *name, DWORD * crc, long *charcnt) {
 }
 
 DWORD crc32buf(char *buf, size_t len) {
-	register DWORD oldcrc32;
-
-	oldcrc32 = 0xFFFFFFFF;
-
-	for (; len; --len, ++buf) {
-		oldcrc32 = UPDC32(*buf, oldcrc32);
-	}
-
-	return ~oldcrc32;
-
+	return crc32_ieee(buf, len);
 }
 
 #ifdef TEST
@@ -1,10 +1,11 @@
 /*
  * a very simple jffs2 unpacker.
- * algorithm is memory intensive but has (almost) linear complexity.
- * at first, the jffs2 is unpacked and put into a map, inode data blocks
- * sorted by version number.
- * then the data blocks are "replayed" in correct order, and memcpy'ed 
- * into a buffer.
+ * algorithm has (almost) linear complexity.
+ * at first, the jffs2 is scanned and the location of every inode data
+ * block is put into a map, sorted by version number.
+ * then the data blocks are "replayed" in correct order into a fragment
+ * tree, and only the newest block for every range is uncompressed
+ * into the output file.
  *
  * usage: jffs2_unpack <jffs2 file> <output directory> <endianess>
  * ...where endianess is 4321 for big endian or 1234 for little endian.
@@ -23,10 +24,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/sysmacros.h>
 #include <sys/socket.h>
@@ -41,17 +46,26 @@
 #define CTL_HW          6               /* generic cpu/io */
 #define HW_NCPU          3              /* int: number of cpus */
 
+#include <algorithm>
 #include <map>
+#include <iterator>
 #include <string>
 #include <list>
 #include <vector>
 #include <set>
+#include <unordered_set>
+
+#include <zlib.h>
 
 #include "mfile.h"
 #include "common.h"
 #include "lzo/lzo1x.h"
 #include "lzma.h"
 #include "util.h"
+#include "thpool.h"
+#include "util_crc32.h"
+#include "util_memscan.h"
+#include "attr_sink.h"
 
 #include "os_byteswap.h"
 #include "jffs2/mini_inflate.h"
@@ -64,8 +78,6 @@
 #define UPPER_BIT_RUBIN    (((long) 1)<<(RUBIN_REG_SIZE-1))
 #define LOWER_BITS_RUBIN   ((((long) 1)<<(RUBIN_REG_SIZE-1))-1)
 
-extern unsigned long crc32_no_comp(unsigned long crc, const unsigned char *buf, int len);
-
 static int swap_words = -1;
 static int verbose = 0;
 static bool guess_es = false;
@@ -230,7 +242,43 @@ void rtime_decompress(unsigned char *data_in, unsigned char *cpage_out, u32 srcl
 	}
 }
 
+/*
+ * a raw inflate context per thread, reset for every node instead of
+ * being set up again
+ */
+struct inflate_ctx {
+	z_stream strm;
+	bool ready;
+
+	inflate_ctx() {
+		memset(&strm, 0, sizeof(strm));
+		ready = (inflateInit2(&strm, -MAX_WBITS) == Z_OK);
+	}
+
+	~inflate_ctx() {
+		if (ready)
+			inflateEnd(&strm);
+	}
+};
+
+static thread_local struct inflate_ctx zctx;
+
 long zlib_decompress(unsigned char *data_in, unsigned char *cpage_out, __u32 srclen, __u32 destlen) {
+	z_stream *strm = &zctx.strm;
+
+	// skip the 2 bytes zlib header, the adler32 at the end isn't checked
+	if (zctx.ready && srclen > 2 && inflateReset(strm) == Z_OK) {
+		strm->next_in = data_in + 2;
+		strm->avail_in = srclen - 2;
+		strm->next_out = cpage_out;
+		strm->avail_out = destlen;
+
+		int ret = inflate(strm, Z_FINISH);
+		if ((ret == Z_STREAM_END || ret == Z_OK || ret == Z_BUF_ERROR) && strm->total_out == destlen)
+			return destlen;
+	}
+
+	// mini_inflate is kept for the streams zlib doesn't like
 	return (decompress_block(cpage_out, data_in + 2, memcpy));
 }
 
@@ -295,208 +343,449 @@ int do_uncompress(void *dst, int dstlen, void *src, int srclen, int type) {
 	return -1;
 }
 
-std::map <int, std::string> inodes;
-std::map <int, __u8> node_type;
-std::map <int, std::list <int> > childs;
-
+/*
+ * an inode data block, left in the image until it's written out
+ */
 struct nodedata_s {
-	unsigned char *data;
-	int size;
-	int offset;
+	off_t node;	// offset of the raw inode node in the image
+	uint32_t offset, dsize, csize;
+	uint8_t compr;
+	bool unchecked;	// data crc not verified yet, indexed from a summary
 
 	int isize, gid, uid, mode;
+};
 
-	nodedata_s(unsigned char *_data, int _size, int _offset, int _isize, int _gid, int _uid, int _mode) {
-		data = (unsigned char *)malloc(_size);
-		size = _size;
-		offset = _offset;
-		memcpy(data, _data, size);
-
-		isize = _isize;
-		gid = _gid;
-		uid = _uid;
-		mode = _mode;
-	} nodedata_s() {
-		data = 0;
-		size = 0;
-		offset = 0;
-
-		isize = 0;
-		gid = 0;
-		uid = 0;
-		mode = 0;
-	}
+/*
+ * a range of an inode, [start, end), whose newest data is in node
+ */
+struct nodefrag_s {
+	uint32_t end;
+	struct nodedata_s *node;
 };
 
-std::map <int, std::map <int, struct nodedata_s>> nodedata;
+/*
+ * an inode, indexed by the rank of its number among those in the image.
+ * The children of a directory are children[child_first] to
+ * children[child_first + child_count - 1]
+ */
+struct inode_s {
+	uint32_t ino;	// number in the image
+	std::string name;
+	uint8_t type;
+	uint32_t child_first, child_count;
+	std::map <int, struct nodedata_s> data;	// by version
+};
+
+static std::vector <struct inode_s> inode_table;
+static std::vector <uint32_t> children;
 
 int whine = 0;
+static uint8_t *image;
 std::string prefix;
 FILE *devtab;
+struct attr_sink *attrs;
 
-void do_list(int inode, std::string root = "") {
-	std::string pathname = prefix + root + inodes[inode];
+/*
+ * replays the data blocks of an inode from the oldest version, each one
+ * hiding what it overwrites of the older ones
+ */
+static void build_fragtree(std::map <int, struct nodedata_s> &data, uint32_t size, std::map <uint32_t, struct nodefrag_s> &tree) {
+	for (auto &i : data) {
+		struct nodedata_s *n = &i.second;
+		uint32_t start = n->offset;
+		uint32_t end = start + n->dsize;
 
-	std::map <int, struct nodedata_s> &data = nodedata[inode];
-	
-	//printf("inode %d -> %s\n", inode, inodes[inode].c_str());
+		if (end > size || end < start)
+			end = size;
 
-	int max_size = 0, gid = 0, uid = 0, mode = 0755;
-	if (!data.empty()) {
-		std::map <int, struct nodedata_s>::iterator last = data.end();
-		--last;
-		max_size = last->second.isize;
-		mode = last->second.mode;
-		gid = last->second.gid;
-		uid = last->second.uid;
+		if (start >= end)
+			continue;
+
+		auto it = tree.lower_bound(start);
+		if (it != tree.begin()) {
+			auto prev = std::prev(it);
+			if (prev->second.end > start) {
+				if (prev->second.end > end)
+					tree[end] = (struct nodefrag_s){prev->second.end, prev->second.node};
+				prev->second.end = start;
+			}
+		}
+
+		while (it != tree.end() && it->first < end) {
+			if (it->second.end > end)
+				tree[end] = (struct nodefrag_s){it->second.end, it->second.node};
+			it = tree.erase(it);
+		}
+
+		tree[start] = (struct nodefrag_s){end, n};
 	}
+}
+
+/*
+ * uncompresses the visible data of an inode, either to fd (holes are left
+ * to the filesystem) or to buf. Nodes that are entirely visible are
+ * uncompressed straight into buf
+ */
+static int write_data(std::map <int, struct nodedata_s> &data, uint32_t size, int fd, uint8_t *buf) {
+	std::map <uint32_t, struct nodefrag_s> tree;
+	std::vector <uint8_t> uncomp;
+	struct nodedata_s *cached = NULL;
+	int errors = 0;
 
-	if ((node_type[inode] == DT_BLK) || (node_type[inode] == DT_CHR))
-		max_size = 2;
+	build_fragtree(data, size, tree);
 
-	unsigned char *merged_data = (unsigned char *)calloc(1, max_size + 1);
-	int devtab_type = 0, major = 0, minor = 0;
+	for (auto &i : tree) {
+		struct nodedata_s *n = i.second.node;
+		uint32_t start = i.first, len = i.second.end - i.first;
+
+		// holes, already zero
+		if (n->compr == JFFS2_COMPR_ZERO)
+			continue;
+
+		if (n != cached) {
+			union jffs2_node_union *node = (union jffs2_node_union *)(image + n->node);
+			int extracted_size;
 
-	for (auto i : data) {
-		int size = i.second.size;
-		int offset = i.second.offset;
-		if (offset + size > max_size)
-			size = max_size - offset;
-		if (size > 0)
-			memcpy(merged_data + i.second.offset, i.second.data, i.second.size);
+			if (n->unchecked && crc32_update(0, node->i.data, n->csize) != fix32(node->i.data_crc)) {
+				errors++;
+				printf("  ** wrong data crc **\n");
+				continue;
+			}
+
+			if (fd < 0 && start == n->offset && len == n->dsize) {
+				if ((extracted_size = do_uncompress(buf + start, len, node->i.data, n->csize, n->compr)) != n->dsize) {
+					errors++;
+					printf("  ** data uncompress failed! (%u =! %u)\n", extracted_size, n->dsize);
+					memset(buf + start, 0, len);
+				}
+				continue;
+			}
+
+			uncomp.resize(n->dsize);
+			cached = n;
+			if ((extracted_size = do_uncompress(uncomp.data(), n->dsize, node->i.data, n->csize, n->compr)) != n->dsize) {
+				errors++;
+				printf("  ** data uncompress failed! (%u =! %u)\n", extracted_size, n->dsize);
+				cached = NULL;
+				continue;
+			}
+		}
+
+		if (fd < 0) {
+			memcpy(buf + start, uncomp.data() + (start - n->offset), len);
+		} else if (pwrite(fd, uncomp.data() + (start - n->offset), len, start) != len) {
+			errors++;
+			break;
+		}
 	}
 
-	switch (node_type[inode]) {
-	case DT_DIR:
-		if (mkdir(pathname.c_str(), mode & 0777)){
-			fprintf(stderr, "mkdir '%s' failed (%s)\n", pathname.c_str(), strerror(errno));
+	return errors;
+}
+
+// size, mode and owner of an inode, from its newest node
+static void inode_attrs(struct inode_s *in, int *size, int *mode, int *uid, int *gid) {
+	*size = 0;
+	*mode = 0755;
+	*uid = *gid = 0;
+
+	if (!in->data.empty()) {
+		struct nodedata_s *last = &in->data.rbegin()->second;
+		*size = last->isize;
+		*mode = last->mode;
+		*gid = last->gid;
+		*uid = last->uid;
+	}
+
+	if ((in->type == DT_BLK) || (in->type == DT_CHR))
+		*size = 2;
+
+	if (*size < 0)
+		*size = 0;
+}
+
+static void devtab_add(const std::string &rel, int type, int mode, int uid, int gid, int major, int minor) {
+	if (devtab) {
+		fprintf(devtab, "%s %c %o %d %d %d %d - - -\n",
+			rel.c_str(), type, mode & 07777, uid, gid, major, minor
+		);
+	}
+}
+
+/*
+ * regular files of a directory, written by the pool while the walk goes
+ * on. The task opens the directory again, so that no descriptor is held
+ * while it waits in the queue
+ */
+#define FILES_PER_TASK 64
+
+struct file_batch {
+	std::string dir;	// path of the directory, with a trailing '/'
+	std::vector <uint32_t> inos;
+};
+
+static void write_files(void *arg) {
+	struct file_batch *batch = (struct file_batch *)arg;
+	int dirfd = open(batch->dir.c_str(), O_RDONLY | O_DIRECTORY);
+
+	if (dirfd < 0) {
+		fprintf(stderr, "open '%s' failed (%s)\n", batch->dir.c_str(), strerror(errno));
+		delete batch;
+		return;
+	}
+
+	for (uint32_t ino : batch->inos) {
+		struct inode_s *in = &inode_table[ino];
+		std::string pathname = batch->dir + in->name;
+		int size, mode, uid, gid;
+
+		inode_attrs(in, &size, &mode, &uid, &gid);
+
+		int fd = openat(dirfd, in->name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+		if (fd < 0) {
+			fprintf(stderr, "open '%s' failed (%s)\n", pathname.c_str(), strerror(errno));
+			continue;
 		}
-		devtab_type = 'd';
-		break;
 
-	case DT_REG:
-		{
-			FILE *f = fopen(pathname.c_str(), "wb");
-			if (!f){
-				fprintf(stderr, "fopen '%s' failed (%s)\n", pathname.c_str(), strerror(errno));
+		/*
+		 * sized up front and uncompressed straight into a mapping of the
+		 * file, the pages that are never written stay holes
+		 */
+		bool failed = (ftruncate(fd, size) < 0);
+		if (!failed && size > 0) {
+			void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (map != MAP_FAILED) {
+				failed = (write_data(in->data, size, -1, (uint8_t *)map) != 0);
+				munmap(map, size);
 			} else {
-				fwrite(merged_data, max_size, 1, f);
-				fclose(f);
+				failed = (write_data(in->data, size, fd, NULL) != 0);
 			}
-			devtab_type = 'f';
-			break;
 		}
-	case DT_LNK:
-		{
-			symlink((char *)merged_data, pathname.c_str());
-			break;
+		if (failed)
+			fprintf(stderr, "failed to write '%s'\n", pathname.c_str());
+		close(fd);
+
+		attr_sink_add(attrs, pathname.c_str(),
+			ATTR_MODE | ((geteuid() == 0) ? ATTR_OWNER : 0),
+			S_IFREG | (mode & 07777), uid, gid, 0
+		);
+	}
+
+	close(dirfd);
+	delete batch;
+}
+
+// copies what is left of a deleted file to a new name
+static void keep_unlinked_file(const std::string &pathname) {
+	const char *cpath = pathname.c_str();
+	int nidx = 0;
+	std::string suffix = "";
+
+	while(access((pathname + suffix).c_str(), F_OK ) != -1){
+		suffix = std::to_string(nidx++);
+	}
+
+	std::string new_name = pathname + suffix;
+	
+	MFILE *f_src = mopen(cpath, O_RDONLY);
+	MFILE *f_dst = mfopen(new_name.c_str(), "w+");
+	if(!f_src || !f_dst){
+		fprintf(stderr, "failed to copy '%s' to '%s'\n", cpath, new_name.c_str());
+		if(f_src)
+			mclose(f_src);
+		if(f_dst)
+			mclose(f_dst);
+	} else {
+		mfile_map(f_dst, msize(f_src));
+		memcpy(
+			mdata(f_dst, void),
+			mdata(f_src, void),
+			msize(f_src)
+		);
+		mclose(f_dst);
+		mclose(f_src);
+	}
+}
+
+/*
+ * creates anything but a regular file in dirfd. rel is the path of the
+ * entry relative to the output directory
+ */
+static void create_entry(int dirfd, const char *name, uint32_t ino, const std::string &rel, std::vector <std::string> &unlinked) {
+	struct inode_s *in = &inode_table[ino];
+	std::string pathname = prefix + rel;
+	int size, mode, uid, gid;
+
+	inode_attrs(in, &size, &mode, &uid, &gid);
+
+	unsigned char *merged_data = NULL;
+	if (in->type == DT_LNK || in->type == DT_CHR || in->type == DT_BLK) {
+		merged_data = (unsigned char *)calloc(1, size + 1);
+		write_data(in->data, size, -1, merged_data);
+	}
+
+	int devtab_type = 0, major = 0, minor = 0;
+	bool created = true;
+
+	switch (in->type) {
+	case DT_DIR:
+		// keep the directory writable until its final mode is applied
+		if (mkdirat(dirfd, name, (mode & 0777) | S_IRWXU)){
+			fprintf(stderr, "mkdir '%s' failed (%s)\n", pathname.c_str(), strerror(errno));
+			created = (errno == EEXIST);
 		}
+		devtab_type = 'd';
+		break;
+	case DT_LNK:
+		created = (symlinkat((char *)merged_data, dirfd, name) == 0);
+		break;
 	case DT_CHR:
 	case DT_BLK:
-		{
-			major = merged_data[1];
-			minor = merged_data[0];
-			if (mknod(pathname.c_str(), ((node_type[inode] == DT_BLK) ? S_IFBLK : S_IFCHR) | (mode & 07777), makedev(major, minor))) {
-				if (!whine++){
-					fprintf(stderr, "mknod '%s' failed (%s)\n", pathname.c_str(), strerror(errno));
-				}
+		major = merged_data[1];
+		minor = merged_data[0];
+		if (mknodat(dirfd, name, ((in->type == DT_BLK) ? S_IFBLK : S_IFCHR) | (mode & 07777), makedev(major, minor))) {
+			if (!whine++){
+				fprintf(stderr, "mknod '%s' failed (%s)\n", pathname.c_str(), strerror(errno));
 			}
-
-			if (node_type[inode] == DT_BLK)
-				devtab_type = 'b';
-			else
-				devtab_type = 'c';
-			break;
+			created = false;
 		}
+
+		if (in->type == DT_BLK)
+			devtab_type = 'b';
+		else
+			devtab_type = 'c';
+		break;
 	case DT_FIFO:
-		{
-			if (mkfifo(pathname.c_str(), mode) < 0)
-				fprintf(stderr, "failed to create FIFO(%s) (%s)\n", pathname.c_str(), strerror(errno));
-			break;
+		if (mkfifoat(dirfd, name, mode) < 0) {
+			fprintf(stderr, "failed to create FIFO(%s) (%s)\n", pathname.c_str(), strerror(errno));
+			created = false;
 		}
+		break;
 	case DT_SOCK: {
 		// create and close a TCP Unix Socket
 		int sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
-		const char *cpath = pathname.c_str();
 		
 		if(sock_fd < 0){
-			fprintf(stderr, "failed to create unix socket '%s' (%s)\n", cpath, strerror(errno));
+			fprintf(stderr, "failed to create unix socket '%s' (%s)\n", pathname.c_str(), strerror(errno));
+			created = false;
 			break;
 		}
 		close(sock_fd);
+		// the socket is never bound, nothing to apply attributes to
+		created = false;
 		break;
 	}
-	case DT_WHT:
-		goto node_warn_uhnandled;
 	case DT_UNKNOWN:
-		//deletion node
-		if(inode == 0){
-			const char *cpath = pathname.c_str();
-		
-			if(keep_unlinked){
-				int nidx = 0;
-				std::string suffix = "";
-
-				while(access((pathname + suffix).c_str(), F_OK ) != -1){
-					suffix = std::to_string(nidx++);
-				}
-
-				std::string new_name = pathname + suffix;
-				
-				MFILE *f_src = mopen(cpath, O_RDONLY);
-				MFILE *f_dst = mfopen(new_name.c_str(), "w+");
-				if(!f_src || !f_dst){
-					fprintf(stderr, "failed to copy '%s' to '%s'\n", cpath, new_name.c_str());
-					if(f_src)
-						mclose(f_src);
-					if(f_dst)
-						mclose(f_dst);
-				} else {
-					mfile_map(f_dst, msize(f_src));
-					memcpy(
-						mdata(f_dst, void),
-						mdata(f_src, void),
-						msize(f_src)
-					);
-					mclose(f_dst);
-					mclose(f_src);
-				}
-			}
-		} else {
-			node_warn_uhnandled:
-			printf("warning:unhandled inode type(%d) for inode %d\n", node_type[inode], inode);
+		//deletion node, handled once the files are written
+		if(ino == 0){
+			if(keep_unlinked)
+				unlinked.push_back(pathname);
+			break;
 		}
+		// fall through
+	default:
+		printf("warning:unhandled inode type(%d) for inode %u\n", in->type, in->ino);
 		break;
 	}
 
 	free(merged_data);
 
-	if (devtab_type && devtab && (inode != 1)){
-		fprintf(devtab, "%s %c %o %d %d %d %d - - -\n",
-			(root + inodes[inode]).c_str(),
-			devtab_type,
-			mode & 07777,
-			uid, gid, major, minor
+	if (devtab_type && ino != 1)
+		devtab_add(rel, devtab_type, mode, uid, gid, major, minor);
+
+	// applied by jffs2extract once the whole tree is there
+	if (created && in->type != DT_UNKNOWN && in->type != DT_WHT) {
+		attr_sink_add(attrs, pathname.c_str(),
+			ATTR_MODE | ((geteuid() == 0) ? ATTR_OWNER : 0),
+			DTTOIF(in->type) | (mode & 07777), uid, gid, 0
 		);
 	}
+}
 
-	if (node_type[inode] != DT_LNK) {
-		if (chmod(pathname.c_str(), mode))
-			if (!whine++){
-				fprintf(stderr, "chmod failed for '%s' (%s)\n", pathname.c_str(), strerror(errno));
+/*
+ * a directory being extracted, the walk goes depth first with an
+ * explicit stack of these
+ */
+struct dir_frame {
+	uint32_t ino;
+	int fd;
+	size_t rel_len;	// length of the directory's path in rel, with the '/'
+	uint32_t next;	// next child to extract
+	struct file_batch *batch;
+};
+
+/*
+ * creates the tree in the output directory. Directories and special
+ * files are created in order, regular files are handed to pool as soon
+ * as their directory exists
+ */
+static void extract_tree(threadpool pool) {
+	std::vector <struct dir_frame> stack;
+	std::vector <std::string> unlinked;
+	std::string rel;
+
+	// the root is the output directory itself
+	create_entry(AT_FDCWD, prefix.c_str(), 1, rel, unlinked);
+
+	int fd = open(prefix.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		fprintf(stderr, "open '%s' failed (%s)\n", prefix.c_str(), strerror(errno));
+		return;
+	}
+	rel = "/";
+	stack.push_back((struct dir_frame){1, fd, rel.size(), 0, NULL});
+
+	while (!stack.empty()) {
+		struct dir_frame *dir = &stack.back();
+		struct inode_s *parent = &inode_table[dir->ino];
+
+		if (dir->next == parent->child_count) {
+			if (dir->batch)
+				thpool_add_work(pool, write_files, dir->batch);
+			close(dir->fd);
+			stack.pop_back();
+			continue;
+		}
+
+		uint32_t ino = children[parent->child_first + dir->next++];
+		struct inode_s *in = &inode_table[ino];
+
+		rel.resize(dir->rel_len);
+		rel += in->name;
+
+		if (in->type == DT_REG) {
+			int size, mode, uid, gid;
+
+			if (dir->batch == NULL) {
+				dir->batch = new file_batch;
+				dir->batch->dir = prefix + rel.substr(0, dir->rel_len);
+			}
+			dir->batch->inos.push_back(ino);
+			if (dir->batch->inos.size() == FILES_PER_TASK) {
+				thpool_add_work(pool, write_files, dir->batch);
+				dir->batch = NULL;
 			}
 
-		if (chown(pathname.c_str(), uid, gid)) {
-#ifndef __CYGWIN__
-			if (!whine++)
-				fprintf(stderr, "chown failed for '%s' (%s)\n", pathname.c_str(), strerror(errno));
-#endif
+			inode_attrs(in, &size, &mode, &uid, &gid);
+			devtab_add(rel, 'f', mode, uid, gid, 0, 0);
+			continue;
+		}
+
+		create_entry(dir->fd, in->name.c_str(), ino, rel, unlinked);
+
+		if (in->type == DT_DIR && in->child_count > 0) {
+			if ((fd = openat(dir->fd, in->name.c_str(), O_RDONLY | O_DIRECTORY)) < 0) {
+				fprintf(stderr, "open '%s' failed (%s)\n", (prefix + rel).c_str(), strerror(errno));
+				continue;
+			}
+			rel += "/";
+			stack.push_back((struct dir_frame){ino, fd, rel.size(), 0, NULL});
 		}
 	}
-//  printf("%s (%d)\n", pathname.c_str(), max_size);
-	std::list < int >&child = childs[inode];
-	for (auto i : child)
-		do_list(i, root + inodes[inode].c_str() + "/");
+
+	thpool_wait(pool);
+
+	for (auto &pathname : unlinked)
+		keep_unlinked_file(pathname);
 }
 
 
@@ -509,15 +798,11 @@ inline int is_jffs2_magic(uint16_t val){
 }
 
 size_t contiguos_region_size(MFILE *mf, off_t offset, uint8_t match_pattern){
-	uint8_t *pStart = mdata(mf, uint8_t);
-	uint8_t *cursor = pStart + offset;
 	size_t fileSz = msize(mf);
-	
-	for(; moff(mf, cursor) < fileSz; cursor++){
-		if(*cursor != match_pattern)
-			break;
-	}
-	return (cursor - pStart) - offset;
+
+	if(offset >= fileSz)
+		return 0;
+	return memspan(mdata(mf, uint8_t) + offset, fileSz - offset, match_pattern);
 }
 
 uint32_t try_guess_es(MFILE *mf, bool *is_reliable){
@@ -526,37 +811,33 @@ uint32_t try_guess_es(MFILE *mf, bool *is_reliable){
 	
 	*is_reliable = false;
 	
-	uint8_t blk16[16];
-	memset(&blk16, 0xFF, sizeof(blk16));
-	
-	// find start of remaining data
+	// find start of remaining data (the first 16 aligned 0xFF block)
 	off_t off = 0;
-	for(; off < fileSz; off += sizeof(blk16)){
-		if(!memcmp(data + off, &blk16, sizeof(blk16)))
+	bool found = false;
+	while(off + 16 <= fileSz){
+		uint8_t *ff = (uint8_t *)memchr(data + off, 0xFF, fileSz - off);
+		if(ff == NULL)
 			break;
+		
+		off = PAD_X(moff(mf, ff), 16);
+		if(off + 16 <= fileSz && memspan(data + off, 16, 0xFF) == 16){
+			found = true;
+			break;
+		}
+		off += 16;
 	}
 	
-	if(off == fileSz)
+	if(!found)
 		return 0;
 	
-	// align to 16
-	int remainder = off % 16;
-	while(remainder > 0){
-		if(*(data + (off++)) != 0xFF)
-			return off;
-	}
-	
 	// find end
-	for(; off < fileSz; off += sizeof(blk16)){
-		if(memcmp(data + off, &blk16, sizeof(blk16)) != 0)
-			break;
-	}
+	off += contiguos_region_size(mf, off, 0xFF) & ~15;
 	
 	// align to next JFFS2 header
 	for(int i=0; i<=32; i++, off++){
 		union jffs2_node_union *hdr = (union jffs2_node_union *)(data + off);
 		if((is_jffs2_magic(hdr->u.magic)) &&
-			crc32_no_comp(0, (uint8_t *)hdr, sizeof(hdr->u) - 4) == fix32(hdr->u.hdr_crc)
+			crc32_update(0, (uint8_t *)hdr, sizeof(hdr->u) - 4) == fix32(hdr->u.hdr_crc)
 		){
 			break;
 		}
@@ -566,7 +847,50 @@ uint32_t try_guess_es(MFILE *mf, bool *is_reliable){
 	return off;
 }
 
-union jffs2_node_union *find_next_node(MFILE *mf, off_t cur_off, int erase_size){
+/*
+ * a range of the image scanned by one worker: the nodes starting in
+ * [start, end) belong to it, the last one may extend past end
+ */
+struct scan_dirent_s {
+	off_t node;
+	uint32_t ino, pino, version;
+	uint8_t type;
+	std::string name;
+};
+
+struct scan_inode_s {
+	uint32_t ino, version;
+	struct nodedata_s data;
+};
+
+struct scan_block_s {
+	MFILE *mf;
+	off_t start, end;
+	off_t next;	// where the scan stopped, past the last node
+	bool resync;	// start might be in the middle of a node
+	int use_es;
+	uint32_t sum_es;	// erase size the summaries are looked for with, 0 for none
+	int errors;
+	std::string log;
+	std::vector <struct scan_dirent_s> dirents;
+	std::vector <struct scan_inode_s> inodes;
+};
+
+// output is kept per block and printed in image order once all are scanned
+static void scan_printf(struct scan_block_s *blk, const char *fmt, ...) {
+	va_list ap;
+	char *msg;
+
+	va_start(ap, fmt);
+	if (vasprintf(&msg, fmt, ap) != -1) {
+		blk->log += msg;
+		free(msg);
+	}
+	va_end(ap);
+}
+
+union jffs2_node_union *find_next_node(struct scan_block_s *blk, off_t cur_off, off_t end, int erase_size){
+	MFILE *mf = blk->mf;
 	uint8_t *data = mdata(mf, uint8_t);
 	size_t fileSz = msize(mf);
 	
@@ -575,7 +899,7 @@ union jffs2_node_union *find_next_node(MFILE *mf, off_t cur_off, int erase_size)
 		size_t empty_fsdata_sz = contiguos_region_size(mf, cur_off, 0x0);
 		if(empty_fsdata_sz != 0){
 			if(verbose)
-				printf("region(0x00) = 0x%x\n", empty_fsdata_sz);
+				scan_printf(blk, "region(0x00) = 0x%zx\n", empty_fsdata_sz);
 		}
 	
 		cur_off += empty_fsdata_sz;
@@ -591,19 +915,29 @@ union jffs2_node_union *find_next_node(MFILE *mf, off_t cur_off, int erase_size)
 		size_t empty_esblks_sz = contiguos_region_size(mf, cur_off, 0xFF);
 		if(empty_esblks_sz != 0){
 			if(verbose)
-				printf("region(0xFF) = 0x%x\n", empty_esblks_sz);
+				scan_printf(blk, "region(0xFF) = 0x%zx\n", empty_esblks_sz);
 		}
 		
 		cur_off += empty_esblks_sz;
 	}
+
+	// nodes are word aligned
+	cur_off &= ~3;
 	
 	find_jffs2:
-	off_t off;
-	for(off = cur_off; off < fileSz;){
+	off_t limit = std::min(end, (off_t)(fileSz - std::min(fileSz, sizeof(struct jffs2_unknown_node)) + 1));
+	for(off_t off = cur_off; off < limit;){
+		// only look at the words holding the magic, in either byte order
+		if(erase_size < 0){
+			off += memfind_magic16(data + off, limit - off, JFFS2_MAGIC_BITMASK);
+			if(off >= limit)
+				break;
+		}
+		
 		union jffs2_node_union *node = (union jffs2_node_union *)(data + off);
 		int r;
 		if((r=is_jffs2_magic(node->u.magic)) &&
-			crc32_no_comp(0, (uint8_t *)node, sizeof(node->u) - 4) == fix32(node->u.hdr_crc)
+			crc32_update(0, (uint8_t *)node, sizeof(node->u) - 4) == fix32(node->u.hdr_crc)
 		){
 			return node;
 		}
@@ -619,174 +953,480 @@ union jffs2_node_union *find_next_node(MFILE *mf, off_t cur_off, int erase_size)
 			off += 4;
 		}
 	}
-	if(off == msize(mf)){
-		return NULL;
-	}
+	return NULL;
 }
 
-extern "C" int jffs2extract(char *infile, char *outdir, struct jffs2_main_args args) {
-	int errors = 0;
-
-	verbose = args.verbose;
-	keep_unlinked = args.keep_unlinked;
-	
-	MFILE *mf = mopen(infile, O_RDONLY);
-	if (!mf) {
-		fprintf(stderr, "Failed to open '%s'\n", infile);
-		return 1;
+/*
+ * adds an inode node to the index. The data crc is left to write_data()
+ * when the node comes from a summary, as the kernel does at mount time
+ */
+static bool scan_inode(struct scan_block_s *blk, union jffs2_node_union *node, bool check_data) {
+	if (crc32_update(0, (unsigned char *)&(node->i), sizeof(struct jffs2_raw_inode) - 8) != fix32(node->i.node_crc)) {
+		blk->errors++;
+		scan_printf(blk, "  ** wrong node crc **\n");
+		return false;
 	}
-	
-	union jffs2_node_union *node = mdata(mf, union jffs2_node_union);
-
-	swap_words = (node->u.magic == KSAMTIB_CIGAM_2SFFJ);
-	
-	bool es_reliable = false;
-	uint32_t es;
-	if(args.erase_size > -1){
-		es = args.erase_size;
-	} else if(guess_es){
-		es = try_guess_es(mf, &es_reliable);
-		printf("> Guessed Erase Size: 0x%x (reliable=%d)\n", es, es_reliable);
+	if (verbose) {
+		scan_printf(blk, "  INODE, ino %lu (version %lu) at %08lx\n", fix32(node->i.ino), fix32(node->i.version), fix32(node->i.offset));
+		scan_printf(blk, "  compression: %d, user compression requested: %d\n", node->i.compr, node->i.usercompr);
+	}
+	int compr_size = fix32(node->i.csize);
+	int uncompr_size = fix32(node->i.dsize);
+	if (verbose)
+		scan_printf(blk, "  compr_size: %d, uncompr_size: %d\n", compr_size, uncompr_size);
+
+	if (check_data) {
+		if (crc32_update(0, node->i.data, compr_size) != fix32(node->i.data_crc)) {
+			blk->errors++;
+			scan_printf(blk, "  ** wrong data crc **\n");
+			return false;
+		}
+		if (verbose)
+			scan_printf(blk, "  data crc ok\n");
 	}
 
+	// only the location is kept, the data is uncompressed when written out
+	struct scan_inode_s in;
+	in.ino = fix32(node->i.ino);
+	in.version = fix32(node->i.version);
+	in.data.node = moff(blk->mf, node);
+	in.data.offset = fix32(node->i.offset);
+	in.data.dsize = uncompr_size;
+	in.data.csize = compr_size;
+	in.data.compr = node->i.compr;
+	in.data.unchecked = !check_data;
+	in.data.isize = fix32(node->i.isize);
+	in.data.gid = fix32(node->i.gid);
+	in.data.uid = fix32(node->i.uid);
+	in.data.mode = fix32(node->i.mode);
+	blk->inodes.push_back(in);
+	return true;
+}
+
+// walks the nodes in [off, end), returns where it stopped
+static off_t scan_range(struct scan_block_s *blk, off_t off, off_t end) {
+	MFILE *mf = blk->mf;
 	uint8_t *data = mdata(mf, uint8_t);
+	union jffs2_node_union *node;
 
-	off_t off = moff(mf, node);
-	while(off + sizeof(*node) < msize(mf)){
+	while(off < end && off + sizeof(*node) < msize(mf)){
 		node = (union jffs2_node_union *)&data[off];		
 		if(!is_jffs2_magic(node->u.magic) || node->u.totlen == 0){
-			printf("invalid node - scanning next node... (offset: %p)\n", off);
+			scan_printf(blk, "invalid node - scanning next node... (offset: 0x%jx)\n", (intmax_t)off);
 			
-			int use_es = -1;
-			if(es_reliable){
-				use_es = es;
-			}
-			node = find_next_node(mf, off, use_es);
+			node = find_next_node(blk, off, end, blk->use_es);
 			if(node == NULL){
-				// reached EOF
+				// reached the end of the range
+				off = end;
 				break;
 			}
 			off_t prev_off = off;
 			off = moff(mf, node);
-			printf("found at %p, after 0x%x bytes\n", off, off - prev_off);
+			scan_printf(blk, "found at 0x%jx, after 0x%jx bytes\n", (intmax_t)off, (intmax_t)(off - prev_off));
 		}
 		
 		off += PAD_U32(node->u.totlen);
 		if (verbose)
-			printf("at %08x: %04x | %04x (%lu bytes): ", off, fix16(node->u.magic), fix16(node->u.nodetype), fix32(node->u.totlen));
+			scan_printf(blk, "at %08jx: %04x | %04x (%lu bytes): ", (intmax_t)off, fix16(node->u.magic), fix16(node->u.nodetype), fix32(node->u.totlen));
 
-		if (crc32_no_comp(0, (unsigned char *)node, sizeof(node->u) - 4) != fix32(node->u.hdr_crc)) {
-			++errors;
-			printf(" ** wrong crc **\n");
+		if (crc32_update(0, (unsigned char *)node, sizeof(node->u) - 4) != fix32(node->u.hdr_crc)) {
+			++blk->errors;
+			scan_printf(blk, " ** wrong crc **\n");
 			continue;
 		}
 		
 		switch (fix16(node->u.nodetype)) {
 			case JFFS2_NODETYPE_DIRENT:
 			{
-				char name[node->d.nsize + 1];
-				strncpy(name, (char *)node->d.name, node->d.nsize);
-				name[node->d.nsize] = 0;
+				// ino and pino size the inode tables, so they must be checked
+				if (moff(mf, node) + sizeof(node->d) + node->d.nsize > msize(mf) ||
+					crc32_update(0, (unsigned char *)&(node->d), sizeof(struct jffs2_raw_dirent) - 8) != fix32(node->d.node_crc)) {
+					++blk->errors;
+					scan_printf(blk, " ** wrong node crc **\n");
+					break;
+				}
+				if (crc32_update(0, node->d.name, node->d.nsize) != fix32(node->d.name_crc)) {
+					++blk->errors;
+					scan_printf(blk, " ** wrong name crc **\n");
+					break;
+				}
+
+				struct scan_dirent_s d;
+				d.node = moff(mf, node);
+				d.ino = fix32(node->d.ino);
+				d.pino = fix32(node->d.pino);
+				d.version = fix32(node->d.version);
+				d.type = node->d.type;
+				d.name.assign((char *)node->d.name, strnlen((char *)node->d.name, node->d.nsize));
 				
 				if (verbose)
-					printf("DIRENT, ino %lu (%s), parent=%lu\n", fix32(node->d.ino), name, fix32(node->d.pino));
+					scan_printf(blk, "DIRENT, ino %lu (%s), parent=%lu\n", (unsigned long)d.ino, d.name.c_str(), (unsigned long)d.pino);
 
-				uint32_t ino = fix32(node->d.ino);
-				uint32_t pino = fix32(node->d.pino);
-				
-				inodes[ino] = name;
-				node_type[ino] = node->d.type;
-				childs[pino].push_back(ino);
+				blk->dirents.push_back(d);
 				break;
 			}
 			case JFFS2_NODETYPE_INODE:
-			{		
-				if (verbose)
-					printf("\n");
-				if (crc32_no_comp(0, (unsigned char *)&(node->i), sizeof(struct jffs2_raw_inode) - 8) != fix32(node->i.node_crc)) {
-					errors++;
-					printf("  ** wrong node crc **\n");
-					continue;
-				}
-				if (verbose) {
-					printf("  INODE, ino %lu (version %lu) at %08lx\n", fix32(node->i.ino), fix32(node->i.version), fix32(node->i.offset));
-					printf("  compression: %d, user compression requested: %d\n", node->i.compr, node->i.usercompr);
-				}
-				int compr_size = fix32(node->i.csize);
-				int uncompr_size = fix32(node->i.dsize);
 				if (verbose)
-					printf("  compr_size: %d, uncompr_size: %d\n", compr_size, uncompr_size);
-				
-				uint8_t *compr = node->i.data;
-				uint8_t uncomp[uncompr_size];
-
-				int extracted_size;
-				if (crc32_no_comp(0, compr, compr_size) != fix32(node->i.data_crc)) {
-					errors++;
-					printf("  ** wrong data crc **\n");
-					continue;
-				} else {
-					if (verbose)
-						printf("  data crc ok\n");
-					if ((extracted_size=do_uncompress(uncomp, uncompr_size, compr, compr_size, node->i.compr)) != uncompr_size) {
-						errors++;
-						printf("  ** data uncompress failed! (%u =! %u)\n", extracted_size, uncompr_size);
-					} else {
-						nodedata[fix32(node->i.ino)][fix32(node->i.version)] = nodedata_s(
-							uncomp, uncompr_size, fix32(node->i.offset),
-							fix32(node->i.isize), fix32(node->i.gid),
-							fix32(node->i.uid), fix32(node->i.mode)
-						);
-#if 0
-						int i;
-						for (i = 0; i < ((uncompr_size + 15) & ~15); ++i) {
-							if ((i & 15) == 0)
-								printf("%08x: ", fix32(node.i.offset) + i);
-							if (i < uncompr_size)
-								printf("%02x ", uncomp[i]);
-							else
-								printf("   ");
-							if ((i & 15) == 15)
-								printf("\n");
-						}
-#endif
-					}
-				}
+					scan_printf(blk, "\n");
+				scan_inode(blk, node, true);
 				break;
-			}
 			case JFFS2_NODETYPE_CLEANMARKER:
 				if (verbose)
-					printf("CLEANMARKER\n");
+					scan_printf(blk, "CLEANMARKER\n");
 				break;
 			case JFFS2_NODETYPE_PADDING:
 				if (verbose)
-					printf("PADDING\n");
+					scan_printf(blk, "PADDING\n");
 				break;
 			case JFFS2_NODETYPE_SUMMARY:
 				if (verbose)
-					printf("SUMMARY\n");
+					scan_printf(blk, "SUMMARY\n");
 				break;
 			default:
-				errors++;
-				printf(" ** INVALID ** - nodetype %04x (offset: %p)\n", fix16(node->u.nodetype), off);
+				blk->errors++;
+				scan_printf(blk, " ** INVALID ** - nodetype %04x (offset: 0x%jx)\n", fix16(node->u.nodetype), (intmax_t)off);
 		}
 	}
 
+	return off;
+}
+
+/*
+ * returns the summary node of the eraseblock at eb, if it ends with a
+ * marker pointing to one with valid crcs
+ */
+static struct jffs2_raw_summary *find_summary(MFILE *mf, off_t eb, uint32_t es) {
+	uint8_t *data = mdata(mf, uint8_t);
+	struct jffs2_sum_marker *marker;
+	struct jffs2_raw_summary *sum;
+	uint32_t sum_off, totlen;
+
+	if (es < sizeof(*sum) + sizeof(*marker) || eb + es > msize(mf))
+		return NULL;
+
+	marker = (struct jffs2_sum_marker *)(data + eb + es - sizeof(*marker));
+	if (fix32(marker->magic) != JFFS2_SUM_MAGIC)
+		return NULL;
+
+	sum_off = fix32(marker->offset);
+	if ((sum_off & 3) || sum_off > es - sizeof(*sum) - sizeof(*marker))
+		return NULL;
+
+	sum = (struct jffs2_raw_summary *)(data + eb + sum_off);
+	totlen = fix32(sum->totlen);
+	if (is_jffs2_magic(sum->magic) <= 0 || fix16(sum->nodetype) != JFFS2_NODETYPE_SUMMARY ||
+		totlen < sizeof(*sum) + sizeof(*marker) || totlen > es - sum_off)
+		return NULL;
+
+	if (crc32_update(0, sum, sizeof(sum->magic) + sizeof(sum->nodetype) + sizeof(sum->totlen)) != fix32(sum->hdr_crc) ||
+		crc32_update(0, sum, sizeof(*sum) - 8) != fix32(sum->node_crc) ||
+		crc32_update(0, sum->sum, totlen - sizeof(*sum)) != fix32(sum->sum_crc))
+		return NULL;
+
+	return sum;
+}
+
+/*
+ * indexes the eraseblock at eb from its summary, reading only the headers
+ * of the inode nodes it lists. Returns false, with nothing added, if the
+ * block has no usable summary and needs a full scan
+ */
+static bool scan_summary(struct scan_block_s *blk, off_t eb, uint32_t es) {
+	MFILE *mf = blk->mf;
+	uint8_t *data = mdata(mf, uint8_t);
+	struct jffs2_raw_summary *sum = find_summary(mf, eb, es);
+	size_t ndirents = blk->dirents.size(), ninodes = blk->inodes.size(), nlog = blk->log.size();
+	int errors = blk->errors;
+
+	if (sum == NULL)
+		return false;
+
+	uint32_t count = fix32(sum->sum_num);
+	uint8_t *rec = (uint8_t *)sum->sum;
+	uint8_t *rec_end = (uint8_t *)sum + fix32(sum->totlen) - sizeof(struct jffs2_sum_marker);
+
+	if (verbose)
+		scan_printf(blk, "at %08jx: summary of %u nodes\n", (intmax_t)eb, count);
+
+	for (uint32_t i = 0; i < count; i++) {
+		if (rec + sizeof(__u16) > rec_end)
+			goto invalid;
+
+		switch (fix16(*(__u16 *)rec)) {
+			case JFFS2_NODETYPE_INODE:
+			{
+				struct jffs2_sum_inode_flash *s = (struct jffs2_sum_inode_flash *)rec;
+				if (rec + sizeof(*s) > rec_end || fix32(s->offset) > es - sizeof(struct jffs2_raw_inode))
+					goto invalid;
+
+				union jffs2_node_union *node = (union jffs2_node_union *)(data + eb + fix32(s->offset));
+				if (is_jffs2_magic(node->u.magic) <= 0 || fix16(node->u.nodetype) != JFFS2_NODETYPE_INODE ||
+					crc32_update(0, (unsigned char *)node, sizeof(node->u) - 4) != fix32(node->u.hdr_crc) ||
+					fix32(node->i.ino) != fix32(s->inode) || fix32(node->i.version) != fix32(s->version))
+					goto invalid;
+
+				scan_inode(blk, node, false);
+				rec += sizeof(*s);
+				break;
+			}
+			case JFFS2_NODETYPE_DIRENT:
+			{
+				struct jffs2_sum_dirent_flash *s = (struct jffs2_sum_dirent_flash *)rec;
+				if (rec + sizeof(*s) > rec_end || rec + sizeof(*s) + s->nsize > rec_end || fix32(s->offset) >= es)
+					goto invalid;
+
+				struct scan_dirent_s d;
+				d.node = eb + fix32(s->offset);
+				d.ino = fix32(s->ino);
+				d.pino = fix32(s->pino);
+				d.version = fix32(s->version);
+				d.type = s->type;
+				d.name.assign((char *)s->name, strnlen((char *)s->name, s->nsize));
+
+				if (verbose)
+					scan_printf(blk, "DIRENT, ino %lu (%s), parent=%lu\n", (unsigned long)d.ino, d.name.c_str(), (unsigned long)d.pino);
+
+				blk->dirents.push_back(d);
+				rec += sizeof(*s) + s->nsize;
+				break;
+			}
+			case JFFS2_NODETYPE_XATTR:
+				rec += sizeof(struct jffs2_sum_xattr_flash);
+				break;
+			case JFFS2_NODETYPE_XREF:
+				rec += sizeof(struct jffs2_sum_xref_flash);
+				break;
+			default:
+				goto invalid;
+		}
+	}
+	return true;
+
+	invalid:
+	blk->dirents.resize(ndirents);
+	blk->inodes.resize(ninodes);
+	blk->log.resize(nlog);
+	blk->errors = errors;
+	scan_printf(blk, "invalid summary in eraseblock 0x%jx, scanning it\n", (intmax_t)eb);
+	return false;
+}
+
+/*
+ * finds the erase size from the summary markers at the end of the first
+ * eraseblocks, 0 if the image has no summaries
+ */
+static uint32_t find_summary_es(MFILE *mf) {
+	for (uint32_t es = 0x1000; es <= 0x200000; es <<= 1) {
+		for (off_t eb = 0; eb < 16 * (off_t)es && eb + es <= msize(mf); eb += es) {
+			if (find_summary(mf, eb, es) != NULL)
+				return es;
+		}
+	}
+	return 0;
+}
+
+// index in the inode tables of inode number ino, which is in inos
+static uint32_t ino_index(const std::vector <uint32_t> &inos, uint32_t ino) {
+	return std::lower_bound(inos.begin(), inos.end(), ino) - inos.begin();
+}
+
+static void scan_block(void *arg) {
+	struct scan_block_s *blk = (struct scan_block_s *)arg;
+	union jffs2_node_union *node;
+	off_t off = blk->start;
+
+	// eraseblocks with a summary don't need to be walked
+	if (blk->sum_es > 0) {
+		blk->next = blk->start;
+		for (off_t eb = blk->start; eb < blk->end; eb += blk->sum_es) {
+			off_t eb_end = std::min(eb + (off_t)blk->sum_es, blk->end);
+
+			if (eb_end - eb == blk->sum_es && scan_summary(blk, eb, blk->sum_es))
+				off = eb_end;
+			else
+				off = scan_range(blk, eb, eb_end);
+			blk->next = std::max(blk->next, off);
+		}
+		return;
+	}
+
+	if (blk->resync) {
+		if ((node = find_next_node(blk, off, blk->end, -1)) == NULL) {
+			blk->next = blk->end;
+			return;
+		}
+		off = moff(blk->mf, node);
+	}
+
+	blk->next = scan_range(blk, off, blk->end);
+}
+
+extern "C" int jffs2extract(char *infile, char *outdir, struct jffs2_main_args args) {
+	int errors = 0;
+
+	verbose = args.verbose;
+	keep_unlinked = args.keep_unlinked;
+	
+	MFILE *mf = mopen(infile, O_RDONLY);
+	if (!mf) {
+		fprintf(stderr, "Failed to open '%s'\n", infile);
+		return 1;
+	}
+	
+	union jffs2_node_union *node = mdata(mf, union jffs2_node_union);
+
+	swap_words = (node->u.magic == KSAMTIB_CIGAM_2SFFJ);
+	
+	bool es_reliable = false;
+	uint32_t es = 0;
+	if(args.erase_size > -1){
+		es = args.erase_size;
+	} else if(guess_es){
+		es = try_guess_es(mf, &es_reliable);
+		printf("> Guessed Erase Size: 0x%x (reliable=%d)\n", es, es_reliable);
+	}
+
+	bool es_known = (args.erase_size > 0 || (es_reliable && es > 0));
+	if(!es_known && (es = find_summary_es(mf)) > 0){
+		printf("> Erase Size from summaries: 0x%x\n", es);
+		es_known = true;
+	}
+
+	uint8_t *data = mdata(mf, uint8_t);
+
+	/*
+	 * nodes never straddle eraseblocks, so when the erase size is known
+	 * the image is split at eraseblock boundaries. Otherwise every block
+	 * but the first one starts by looking for a node header, and the
+	 * nodes it finds inside the last node of the previous block are
+	 * dropped when merging
+	 */
+	int nThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	off_t chunk = std::max((off_t)msize(mf) / (nThreads * 4), (off_t)0x40000);
+	chunk = es_known ? PAD_X(chunk, (off_t)es) : PAD_U32(chunk);
+
+	std::vector <struct scan_block_s> blocks;
+	for (off_t start = moff(mf, node); start < msize(mf); start += chunk) {
+		struct scan_block_s blk;
+		blk.mf = mf;
+		blk.start = start;
+		blk.end = std::min(start + chunk, (off_t)msize(mf));
+		blk.next = start;
+		blk.resync = (start > 0 && !es_known);
+		blk.use_es = es_reliable ? es : -1;
+		blk.sum_es = es_known ? es : 0;
+		blk.errors = 0;
+		blocks.push_back(blk);
+	}
+
+	threadpool pool = thpool_init(nThreads);
+	for (auto &blk : blocks)
+		thpool_add_work(pool, scan_block, &blk);
+	thpool_wait(pool);
+
+	/*
+	 * inode numbers can be anything in a damaged image, so the tables are
+	 * indexed by their rank. 0 (deletions) and 1 (the root) are always
+	 * there and keep their number
+	 */
+	std::vector <uint32_t> inos = {0, 1};
+	for (auto &blk : blocks) {
+		for (auto &d : blk.dirents) {
+			inos.push_back(d.ino);
+			inos.push_back(d.pino);
+		}
+		for (auto &in : blk.inodes)
+			inos.push_back(in.ino);
+	}
+	std::sort(inos.begin(), inos.end());
+	inos.erase(std::unique(inos.begin(), inos.end()), inos.end());
+
+	/*
+	 * merged in image order, the newest dirent of an inode gives its name.
+	 * The children are then laid out per directory in the order found
+	 */
+	size_t n_inodes = inos.size();
+	std::vector <struct inode_s>(n_inodes).swap(inode_table);
+	std::vector <uint32_t> dirent_version(n_inodes);
+	std::vector <bool> named(n_inodes);
+	for (size_t i = 0; i < n_inodes; i++)
+		inode_table[i].ino = inos[i];
+	std::vector <std::pair <uint32_t, uint32_t>> links;	// parent, child
+	std::unordered_set <uint64_t> linked;
+	off_t scanned = 0;
+	for (auto &blk : blocks) {
+		fputs(blk.log.c_str(), stdout);
+		errors += blk.errors;
+
+		for (auto &d : blk.dirents) {
+			if (d.node < scanned)
+				continue;
+
+			uint32_t ino = ino_index(inos, d.ino), pino = ino_index(inos, d.pino);
+			if (!named[ino] || d.version >= dirent_version[ino]) {
+				named[ino] = true;
+				dirent_version[ino] = d.version;
+				inode_table[ino].name = d.name;
+				inode_table[ino].type = d.type;
+			}
+
+			// every deletion dirent is kept, they all refer to inode 0
+			if (ino == 0 || linked.insert(((uint64_t)pino << 32) | ino).second)
+				links.push_back(std::make_pair(pino, ino));
+		}
+
+		for (auto &in : blk.inodes) {
+			if (in.data.node < scanned)
+				continue;
+			inode_table[ino_index(inos, in.ino)].data[in.version] = in.data;
+		}
+
+		scanned = std::max(scanned, blk.next);
+	}
+	blocks.clear();
+	std::vector <uint32_t>().swap(inos);
+
+	for (auto &l : links)
+		inode_table[l.first].child_count++;
+
+	uint32_t first = 0;
+	for (auto &in : inode_table) {
+		in.child_first = first;
+		first += in.child_count;
+		in.child_count = 0;
+	}
+
+	children.resize(links.size());
+	for (auto &l : links) {
+		struct inode_s *parent = &inode_table[l.first];
+		children[parent->child_first + parent->child_count++] = l.second;
+	}
+
 	if (errors) {
-		if (!inodes.empty())
+		if (!links.empty())
 			printf("there were errors, but some valid stuff was detected. continuing.\n");
 		else {
 			fprintf(stderr, "errors present and no valid data.\n");
+			thpool_destroy(pool);
 			mclose(mf);
 			return 2;
 		}
 	}
 	
-	node_type[1] = DT_DIR;
+	inode_table[1].type = DT_DIR;
 	prefix = outdir;
+	image = data;
 	devtab = fopen((prefix + ".devtab").c_str(), "wb");
-	do_list(1);
-	fclose(devtab);
+	attrs = attr_sink_new();
+	extract_tree(pool);
+	thpool_destroy(pool);
+	attr_sink_apply(attrs, nThreads);
+	attr_sink_free(attrs);
+	if (devtab)
+		fclose(devtab);
+
+	std::vector <struct inode_s>().swap(inode_table);
+	std::vector <uint32_t>().swap(children);
 
 	mclose(mf);
 	return 0;
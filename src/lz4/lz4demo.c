@@ -45,9 +45,14 @@
 #    include <io.h>				// _setmode
 #    include <fcntl.h>			// _O_BINARY
 #endif
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "lz4.h"
 #include "lz4hc.h"
 #include "bench.h"
+#include "mfile.h"
+#include "thpool.h"
 
 //**************************************
 // Compiler functions
@@ -238,101 +243,159 @@ int compress_file(char *input_filename, char *output_filename, int compressionle
 	return 0;
 }
 
+struct decode_block {
+	const char *in;
+	uint32_t in_size;
+	char *out;
+	int last;
+	int result;
+};
+
+static void decode_block(struct decode_block *block) {
+	if (block->last) {
+		// the last block can be short, its output size is found while decoding
+		block->result = LZ4_uncompress_unknownOutputSize(block->in, block->out, block->in_size, CHUNKSIZE);
+	} else {
+		// the other blocks are full, and must use up all of their input
+		block->result = LZ4_uncompress(block->in, block->out, CHUNKSIZE);
+	}
+}
+
+/*
+ * The offsets of every block in the input and the output are known from
+ * the sizes table, so the blocks are decoded concurrently from the mapped
+ * input into the mapped output, sized for full blocks and cut down to the
+ * size of the last one afterwards
+ */
 int LZ4_decode_file(const char *input_filename, const char *output_filename) {
 	unsigned long long filesize = 0;
-	char *in_buff;
-	char *out_buff;
-	size_t uselessRet;
-	int sinkint;
-	uint32_t chunkSize[ARCHIVE_MAGICNUMBER_SIZE / 4];
-	FILE *finput;
-	FILE *foutput;
-	clock_t start, end;
-	int r;
+	const uint32_t *chunkSize;
+	struct timespec start, end;
+	int ret = 0;
 
 	// Init
-	start = clock();
-	r = get_fileHandle(input_filename, output_filename, &finput, &foutput);
-	if (r)
-		return r;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	MFILE *finput = mopen(input_filename, O_RDONLY);
+	if (finput == NULL) {
+		DISPLAY("Pb opening %s\n", input_filename);
+		return 2;
+	}
 
 	// Check Archive Header
-	uselessRet = fread(chunkSize, 1, ARCHIVE_MAGICNUMBER_SIZE, finput);
-	if (!uselessRet) {
+	if (msize(finput) < ARCHIVE_MAGICNUMBER_SIZE) {
 		DISPLAY("Cannot read header\n");
+		mclose(finput);
 		return -1;
 	}
+	chunkSize = mdata(finput, uint32_t);
 	//LITTLE_ENDIAN32(chunkSize);
 	if (chunkSize[0] != ARCHIVE_MAGICNUMBER) {
 		DISPLAY("Unrecognized header : file cannot be decoded\n");
+		mclose(finput);
 		return 6;
 	}
-	// Allocate Memory
+
 	CHUNKSIZE = (uint32_t) chunkSize[3];
-	in_buff = (char *)malloc(CHUNKSIZE + CHUNKSIZE / 0xFF + 64);
-	out_buff = (char *)malloc(CHUNKSIZE);
-	if (!in_buff || !out_buff) {
+	uint32_t n;
+	uint32_t numOfSizes = chunkSize[4];
+	const uint32_t *sizesTable = chunkSize + ARCHIVE_MAGICNUMBER_SIZE / 4;
+	if (numOfSizes == 0 || numOfSizes > (msize(finput) - ARCHIVE_MAGICNUMBER_SIZE) / 4) {
+		DISPLAY("Cannot read sizes table\n");
+		mclose(finput);
+		return -1;
+	}
+
+	// Blocks that lie past the end of the input aren't decoded
+	uint32_t numOfBlocks = numOfSizes;
+	uint64_t in_off = ARCHIVE_MAGICNUMBER_SIZE + 4 * (uint64_t)numOfSizes;
+	struct decode_block *blocks = calloc(numOfSizes, sizeof(struct decode_block));
+	if (blocks == NULL) {
 		DISPLAY("Allocation error : not enough memory\n");
+		mclose(finput);
 		return 7;
 	}
+	for (n = 0; n < numOfSizes; n++) {
+		if (sizesTable[n] == 0 || in_off + sizesTable[n] > msize(finput)) {
+			numOfBlocks = n;
+			break;
+		}
+		blocks[n].in = mdata(finput, char) + in_off;
+		blocks[n].in_size = sizesTable[n];
+		blocks[n].last = (n == numOfSizes - 1);
+		in_off += sizesTable[n];
+	}
 
-	uint32_t n = 0;
-	uint32_t nextSize;
-	uint32_t numOfSizes = chunkSize[4];
-	uint32_t *sizesTable = (uint32_t *) malloc(4 * numOfSizes);
-	uselessRet = fread(sizesTable, 4, numOfSizes, finput);
-	if (!uselessRet) {
-		DISPLAY("Cannot read sizes table\n");
-		return -1;
+	int fd = open(output_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		DISPLAY("Pb opening %s\n", output_filename);
+		free(blocks);
+		mclose(finput);
+		return 3;
 	}
-	filesize = 0LL;
-	while (1) {					// Main Loop
-		nextSize = sizesTable[n];
-		uselessRet = fread(in_buff, 1, nextSize, finput);
-		if (!uselessRet) {
-			DISPLAY("Cannot read header\n");
-			return -1;
+
+	size_t outSize = (size_t)numOfBlocks * CHUNKSIZE;
+	char *out = NULL;
+	if (outSize > 0) {
+		if (ftruncate(fd, outSize) < 0 || (out = mmap(NULL, outSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+			DISPLAY("Allocation error : not enough memory\n");
+			close(fd);
+			free(blocks);
+			mclose(finput);
+			return 7;
 		}
-		if (n >= numOfSizes - 1) {
-			// Decode Block
-			sinkint = LZ4_uncompress_unknownOutputSize(in_buff, out_buff, nextSize, CHUNKSIZE);
-			if (sinkint < 0) {
+	}
+
+	threadpool pool = thpool_init(sysconf(_SC_NPROCESSORS_ONLN));
+	for (n = 0; n < numOfBlocks; n++) {
+		blocks[n].out = out + (size_t)n * CHUNKSIZE;
+		thpool_add_work(pool, (void *)decode_block, &blocks[n]);
+	}
+	thpool_wait(pool);
+	thpool_destroy(pool);
+
+	// Blocks are checked in order, the output ends before the first bad one
+	for (n = 0; n < numOfBlocks; n++) {
+		if (blocks[n].last) {
+			if (blocks[n].result < 0) {
 				DISPLAY("Decoding Failed ! Corrupted input !\n");
-				return 9;
+				ret = 9;
+				break;
 			}
-			filesize += sinkint;
-
-			// Write Block
-			fwrite(out_buff, 1, sinkint, foutput);
+			filesize += blocks[n].result;
 			break;
 		}
-		uint32_t res = LZ4_uncompress(in_buff, out_buff, CHUNKSIZE);
-		if (nextSize != res) {
-			printf("Uncompress error. n:%d, res:%X, nextSize:%X\n", n, res, nextSize);
-			return 8;
+		if (sizesTable[n] != (uint32_t)blocks[n].result) {
+			printf("Uncompress error. n:%d, res:%X, nextSize:%X\n", n, blocks[n].result, sizesTable[n]);
+			ret = 8;
+			break;
 		}
 		filesize += CHUNKSIZE;
-		++n;
-		fwrite(out_buff, 1, CHUNKSIZE, foutput);
-		if (n >= numOfSizes)
-			break;
 	}
+	if (ret == 0 && numOfBlocks < numOfSizes) {
+		DISPLAY("Cannot read header\n");
+		ret = -1;
+	}
+
+	if (out != NULL)
+		munmap(out, outSize);
+	if (ftruncate(fd, filesize) < 0)
+		DISPLAY("Pb writing %s\n", output_filename);
+	close(fd);
 
 	// Status
-	end = clock();
-	DISPLAY("Successfully decoded %llu bytes. ", (unsigned long long)filesize); {
-		double seconds = (double)(end - start) / CLOCKS_PER_SEC;
-		DISPLAY("Done in %.2f s ==> %.2f MB/s\n", seconds, (double)filesize / seconds / 1024 / 1024);
+	if (ret == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		DISPLAY("Successfully decoded %llu bytes. ", (unsigned long long)filesize); {
+			double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+			DISPLAY("Done in %.2f s ==> %.2f MB/s\n", seconds, (double)filesize / seconds / 1024 / 1024);
+		}
 	}
 
 	// Close & Free
-	free(sizesTable);
-	free(in_buff);
-	free(out_buff);
-	fclose(finput);
-	fclose(foutput);
+	free(blocks);
+	mclose(finput);
 
-	return 0;
+	return ret;
 }
 
 //int main(int argc, char** argv)
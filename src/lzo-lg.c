@@ -38,8 +38,15 @@
  **************************************************************************/
 #include "common.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <zlib.h>
+
 #include "lzo/lzoconf.h"
 #include "lzo/lzo1x.h"
+#include "mfile.h"
+#include "thpool.h"
 
 /* portability layer */
 #define WANT_LZO_MALLOC 1
@@ -381,6 +388,248 @@ int do_decompress(FILE * fi, FILE * fo) {
 	return r;
 }
 
+/*************************************************************************
+ // decompress a mapped file
+ //
+ // A first pass over the block headers finds where every block is in the
+ // input and in the output, then the blocks are decompressed in parallel
+ // straight into the mapped output file. Each block gets its own
+ // checksum, and the checksums are combined in order afterwards.
+ **************************************************************************/
+
+struct lzo_block {
+	const unsigned char *in;
+	lzo_uint in_len;
+	lzo_uint out_len;
+	lzo_bytep out;
+	int check;
+	int ok;
+	int r;
+	lzo_uint32 checksum;
+};
+
+static lzo_uint32 get32(const unsigned char *b) {
+	return ((lzo_uint32) b[0] << 24) | ((lzo_uint32) b[1] << 16) | ((lzo_uint32) b[2] << 8) | (lzo_uint32) b[3];
+}
+
+static void decompress_block(struct lzo_block *block) {
+	block->ok = 1;
+	if (block->in_len < block->out_len) {
+		/* use safe decompressor as data might be corrupted during a file transfer */
+		lzo_uint new_len = block->out_len;
+
+		block->r = lzo1x_decompress_safe(block->in, block->in_len, block->out, &new_len, NULL);
+		if (block->r != LZO_E_OK || new_len != block->out_len) {
+			block->ok = 0;
+			return;
+		}
+	} else {
+		/* original (incompressible) block */
+		memcpy(block->out, block->in, block->in_len);
+	}
+
+	if (block->check)
+		block->checksum = lzo_adler32(lzo_adler32(0, NULL, 0), block->out, block->out_len);
+}
+
+static int do_decompress_mapped(MFILE * fi, const char *out_name) {
+	const unsigned char *data = mdata(fi, unsigned char);
+	size_t size = msize(fi), pos = 0;
+	struct lzo_block *blocks = NULL;
+	size_t nblocks = 0, max_blocks = 0, i;
+	size_t out_size = 0, done_size = 0;
+	int r = 0, level = 0, method;
+	int size_error = 0, eof_error = 0;
+	lzo_uint32 flags, block_size, checksum, stored_checksum = 0;
+	lzo_bytep out = NULL;
+
+	int fo = open(out_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fo < 0) {
+		printf("cannot open output file %s\n", out_name);
+		exit(1);
+	}
+
+#define HAVE(n) (size - pos >= (n))
+
+	/*
+	 * Step 1: check magic header, read flags & block size
+	 */
+	if (!HAVE(sizeof(magic)) || memcmp(data, magic, sizeof(magic)) != 0) {
+		r = 1;
+		goto err;
+	}
+	pos += sizeof(magic);
+
+	if (!HAVE(5)) {
+		eof_error = 1;
+		goto blocks_done;
+	}
+	flags = get32(data + pos);
+	method = data[pos + 4];
+	pos += 5;
+
+	if (method != 1) {
+		// check for different LZO header including version
+		pos--;
+		if (!HAVE(5)) {
+			eof_error = 1;
+			goto blocks_done;
+		}
+		uint32_t version = get32(data + pos);
+		method = data[pos + 4];
+		pos += 5;
+		if (version != 1 || method != 1) {
+			printf("header error - invalid method %d (version: %d) (level %d)\n", method, version, level);
+			r = 2;
+			goto err;
+		}
+	}
+
+	if (!HAVE(5)) {
+		eof_error = 1;
+		goto blocks_done;
+	}
+	level = data[pos];
+	block_size = get32(data + pos + 1);
+	pos += 5;
+	if (block_size < 1024 || block_size > 8 * 1024 * 1024L) {
+		printf("header error - invalid block size %ld\n", (long)block_size);
+		r = 3;
+		goto err;
+	}
+
+	/*
+	 * Step 2: find the blocks. Errors are only reported once the blocks
+	 * before them are done, as when decompressing one block at a time
+	 */
+	for (;;) {
+		lzo_uint in_len, out_len;
+
+		if (!HAVE(4)) {
+			eof_error = 1;
+			break;
+		}
+		out_len = get32(data + pos);
+		pos += 4;
+
+		/* exit if last block (EOF marker) */
+		if (out_len == 0) {
+			if (flags & 1) {
+				if (HAVE(4))
+					stored_checksum = get32(data + pos);
+				else
+					eof_error = 1;
+			}
+			break;
+		}
+
+		if (!HAVE(4)) {
+			eof_error = 1;
+			break;
+		}
+		in_len = get32(data + pos);
+		pos += 4;
+
+		/* sanity check of the size values */
+		if (in_len > block_size || out_len > block_size || in_len == 0 || in_len > out_len) {
+			size_error = 1;
+			break;
+		}
+		if (!HAVE(in_len)) {
+			eof_error = 1;
+			break;
+		}
+
+		if (nblocks == max_blocks) {
+			max_blocks = max_blocks ? max_blocks * 2 : 256;
+			blocks = realloc(blocks, max_blocks * sizeof(*blocks));
+			if (blocks == NULL) {
+				printf("out of memory\n");
+				r = 4;
+				goto err;
+			}
+		}
+		blocks[nblocks].in = data + pos;
+		blocks[nblocks].in_len = in_len;
+		blocks[nblocks].out_len = out_len;
+		blocks[nblocks].check = flags & 1;
+		nblocks++;
+
+		pos += in_len;
+		out_size += out_len;
+	}
+
+	/*
+	 * Step 3: decompress the blocks into the output
+	 */
+	if (out_size > 0) {
+		if (ftruncate(fo, out_size) < 0 || (out = mmap(NULL, out_size, PROT_READ | PROT_WRITE, MAP_SHARED, fo, 0)) == MAP_FAILED) {
+			out = NULL;
+			printf("\nwrite error  (disk full ?)\n");
+			exit(1);
+		}
+
+		threadpool pool = thpool_init(sysconf(_SC_NPROCESSORS_ONLN));
+		for (i = 0; i < nblocks; i++) {
+			blocks[i].out = out + done_size;
+			done_size += blocks[i].out_len;
+			thpool_add_work(pool, (void *)decompress_block, &blocks[i]);
+		}
+		thpool_wait(pool);
+		thpool_destroy(pool);
+	}
+
+	/* the output ends before the first bad block */
+	checksum = lzo_adler32(0, NULL, 0);
+	for (i = 0, done_size = 0; i < nblocks; i++) {
+		if (!blocks[i].ok) {
+			printf("compressed data violation: %u\n", (unsigned int)blocks[i].r);
+			r = 6;
+			goto err;
+		}
+		if (flags & 1)
+			checksum = adler32_combine(checksum, blocks[i].checksum, blocks[i].out_len);
+		done_size += blocks[i].out_len;
+	}
+
+ blocks_done:
+	if (eof_error) {
+		fprintf(stderr, "\nread error - premature end of file\n");
+		if (out != NULL)
+			munmap(out, out_size);
+		if (ftruncate(fo, done_size) < 0 || close(fo) != 0)
+			printf("error while closing file\n");
+		exit(1);
+	}
+
+	if (size_error) {
+		printf("block size error - data corrupted\n");
+		r = 5;
+		goto err;
+	}
+
+	/* verify checksum */
+	if ((flags & 1) && stored_checksum != checksum) {
+		printf("checksum error - data corrupted\n");
+		r = 7;
+		goto err;
+	}
+
+	r = 0;
+ err:
+#undef HAVE
+	total_in = pos;
+	total_out = done_size;
+	if (out != NULL)
+		munmap(out, out_size);
+	if (ftruncate(fo, done_size) < 0 || close(fo) != 0) {
+		printf("error while closing file\n");
+		exit(1);
+	}
+	free(blocks);
+	return r;
+}
+
 /*************************************************************************
  //
  **************************************************************************/
@@ -496,6 +745,16 @@ int __lzo_cdecl_main lzo_unpack(const char *in_name, const char *out_name) {
 	/*
 	 * Step 4: process file(s)
 	 */
+	MFILE *mf = mopen(in_name, O_RDONLY);
+	if (mf != NULL && msize(mf) > 0) {
+		fi_size = (lzo_uint32) msize(mf);
+		r = do_decompress_mapped(mf, out_name);
+		mclose(mf);
+		return r;
+	}
+	if (mf != NULL)
+		mclose(mf);
+
 	fi = xopen_fi(in_name);
 	fo = xopen_fo(out_name);
 	r = do_decompress(fi, fo);
@@ -23,12 +23,13 @@
 #include "epk2.h"		/* EPK v2 */
 #include "epk3.h"		/* EPK v3 */
 #include "cramfs/cramfs.h"	/* CRAMFS */
-#include "cramfs/cramfsswap.h"
 #include "lz4/lz4.h"	/* LZ4 */
 #include "lzo/lzo.h"	/* LZO */
 #include "lzhs/lzhs.h"	/* LZHS */
 #include "jffs2/jffs2.h"	/* JFFS2 */
 #include "squashfs/unsquashfs.h"	/* SQUASHFS */
+#include "squashfs/unsquashfs_dedup.h"
+#include "squashfs/unsquashfs_tar.h"
 #include "minigzip.h"	/* GZIP */
 #include "symfile.h"	/* SYM */
 #include "stream/tsfile.h"		/* STR and PIF */
@@ -90,9 +91,16 @@ int handle_file(char *file, config_opts_t *config_opts) {
 	/* SQUASHFS */
 	} else if (is_squashfs(file)) {
 		asprintf(&dest_file, "%s/%s.unsquashfs", dest_dir, file_name);
-		printf("UnSQUASHFS file to: %s\n", dest_file);
-		rmrf(dest_file);
-		unsquashfs(file, dest_file);
+		if (config_opts->squashfs_tar == NULL)
+			rmrf(dest_file);
+		dedup_mode = config_opts->squashfs_dedup;
+		if (config_opts->squashfs_path != NULL) {
+			printf("UnSQUASHFS %s from file to: %s\n", config_opts->squashfs_path, dest_file);
+			unsquashfs_path(file, dest_file, config_opts->squashfs_path);
+		} else {
+			printf("UnSQUASHFS file to: %s\n", dest_file);
+			unsquashfs(file, dest_file);
+		}
 	/* GZIP */
 	} else if (is_gzip(file)) {
 		asprintf(&dest_file, "%s/", dest_dir);
@@ -109,12 +117,12 @@ int handle_file(char *file, config_opts_t *config_opts) {
 
 		printf("[MTK] Extracting embedded LZHS files...\n");
 		extract_lzhs(mf);
-	/* CRAMFS Big Endian */
+	/* CRAMFS Big Endian, read in place */
 	} else if (is_cramfs_image(file, "be")) {
-		asprintf(&dest_file, "%s/%s.cramswap", dest_dir, file_name);
-		printf("Swapping cramfs endian for file %s\n", file);
-		cramswap(file, dest_file);
-		handle_file(dest_file, config_opts);
+		asprintf(&dest_file, "%s/%s.uncramfs", dest_dir, file_name);
+		printf("UnCRAMFS (big endian) %s to folder %s\n", file, dest_file);
+		rmrf(dest_file);
+		uncramfs(dest_file, file);
 	/* CRAMFS Little Endian */
 	} else if (is_cramfs_image(file, "le")) {
 		asprintf(&dest_file, "%s/%s.uncramfs", dest_dir, file_name);
@@ -160,6 +168,16 @@ int handle_file(char *file, config_opts_t *config_opts) {
 		asprintf(&dest_file, "%s/%s.idc", dest_dir, file_name);
 		printf("Converting SYM file to IDC script: %s\n", dest_file);
 		symfile_write_idc(dest_file);
+		free(dest_file);
+
+		asprintf(&dest_file, "%s/%s.map", dest_dir, file_name);
+		printf("Converting SYM file to symbol map: %s\n", dest_file);
+		symfile_export(&sym_table, dest_file, SYMFILE_MAP);
+		free(dest_file);
+
+		asprintf(&dest_file, "%s/%s.elf", dest_dir, file_name);
+		printf("Converting SYM file to ELF symbol table: %s\n", dest_file);
+		symfile_export(&sym_table, dest_file, SYMFILE_ELF);
 	/* MTK LZHS (Modified LZSS + Huffman) */
 	} else if ((mf=is_lzhs(file))) {
 		asprintf(&dest_file, "%s/%s.unlzhs", dest_dir, file_name);
@@ -191,7 +209,11 @@ int main(int argc, char *argv[]) {
 		printf("Usage: epk2extract [-options] FILENAME\n\n");
 		printf("Options:\n");
 		printf("  -c : extract to current directory instead of source file directory\n");
-		printf("  -s : enable signature checking for EPK files\n\n");
+		printf("  -s : enable signature checking for EPK files\n");
+		printf("  -e PATH : only extract PATH (e.g. /etc/starfish-release) from SQUASHFS images\n");
+		printf("  -d MODE : output of duplicate files in SQUASHFS images (none, clone, copy, link; default clone)\n");
+		printf("  -t FILE : write SQUASHFS images to the tar archive FILE (- for stdout) instead of extracting them\n");
+		printf("  -i MSEC : PCR interval of the seek index (FILE.ts.idx) written with converted STR/PIF recordings (default 1000, 0 for none)\n\n");
 		return err_ret("");
 	}
 
@@ -216,9 +238,13 @@ int main(int argc, char *argv[]) {
 	config_opts.config_dir = my_dirname(exe_dir);
 	config_opts.dest_dir = calloc(1, PATH_MAX);
 	config_opts.enableSignatureChecking = 0;
+	config_opts.squashfs_path = NULL;
+	config_opts.squashfs_dedup = DEDUP_DEFAULT;
+	config_opts.squashfs_tar = NULL;
+	config_opts.ts_index_interval = 1000;
 
 	int opt;
-	while ((opt = getopt(argc, argv, "cs")) != -1) {
+	while ((opt = getopt(argc, argv, "cse:d:t:i:")) != -1) {
 		switch (opt) {
 		case 's':{
 			config_opts.enableSignatureChecking = 1;
@@ -228,6 +254,29 @@ int main(int argc, char *argv[]) {
 				strcpy(config_opts.dest_dir, current_dir);
 				break;
 			}
+		case 'e':{
+				config_opts.squashfs_path = optarg;
+				break;
+			}
+		case 'd':{
+				if ((config_opts.squashfs_dedup = dedup_parse_mode(optarg)) == -1) {
+					printf("Unknown duplicate mode: `%s'\n\n", optarg);
+					return 1;
+				}
+				break;
+			}
+		case 't':{
+				config_opts.squashfs_tar = optarg;
+				if (tar_output(optarg) == -1) {
+					printf("Can't open `%s' for writing\n\n", optarg);
+					return 1;
+				}
+				break;
+			}
+		case 'i':{
+				config_opts.ts_index_interval = atoi(optarg);
+				break;
+			}
 		case ':':{
 				printf("Option `%c' needs a value\n\n", optopt);
 				exit(1);
@@ -266,6 +315,7 @@ int main(int argc, char *argv[]) {
 
 	lzhs_init_lookup();
 	int exit_code = handle_file(input_file, &config_opts);
+	tar_close();
 	
 	if (exit_code == EXIT_FAILURE)
 		return err_ret("Unsupported input file format: %s\n\n", input_file);
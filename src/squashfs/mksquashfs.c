@@ -34,6 +34,7 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <sys/types.h>
+#include <sys/sysmacros.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -51,7 +52,7 @@
 #include <limits.h>
 #include <ctype.h>
 
-#ifndef linux
+#ifndef __linux__
 #    define __BYTE_ORDER BYTE_ORDER
 #    define __BIG_ENDIAN BIG_ENDIAN
 #    define __LITTLE_ENDIAN LITTLE_ENDIAN
@@ -721,11 +722,11 @@ char *subpathname(struct dir_ent *dir_ent) {
 	return subpath;
 }
 
-inline unsigned int get_inode_no(struct inode_info *inode) {
+static inline unsigned int get_inode_no(struct inode_info *inode) {
 	return inode->inode_number;
 }
 
-inline unsigned int get_parent_no(struct dir_info *dir) {
+static inline unsigned int get_parent_no(struct dir_info *dir) {
 	return dir->depth ? get_inode_no(dir->dir_ent->inode) : inode_no;
 }
 
@@ -1738,7 +1739,7 @@ struct file_info *duplicate(long long file_size, long long bytes, unsigned int *
 	return add_non_dup(file_size, bytes, *block_list, *start, *fragment, checksum, fragment_checksum, checksum_flag, TRUE);
 }
 
-inline int is_fragment(struct inode_info *inode) {
+static inline int is_fragment(struct inode_info *inode) {
 	int file_size = inode->buf.st_size;
 
 	/*
@@ -2620,16 +2621,16 @@ struct inode_info *lookup_inode2(struct stat *buf, int pseudo, int id) {
 	return inode;
 }
 
-inline struct inode_info *lookup_inode(struct stat *buf) {
+static inline struct inode_info *lookup_inode(struct stat *buf) {
 	return lookup_inode2(buf, 0, 0);
 }
 
-inline void alloc_inode_no(struct inode_info *inode, unsigned int use_this) {
+static inline void alloc_inode_no(struct inode_info *inode, unsigned int use_this) {
 	if (inode->inode_number == 0)
 		inode->inode_number = use_this ? : inode_no++;
 }
 
-inline struct dir_ent *create_dir_entry(char *name, char *source_name, char *nonstandard_pathname, struct dir_info *dir) {
+static inline struct dir_ent *create_dir_entry(char *name, char *source_name, char *nonstandard_pathname, struct dir_info *dir) {
 	struct dir_ent *dir_ent = malloc(sizeof(struct dir_ent));
 	if (dir_ent == NULL)
 		MEM_ERROR();
@@ -2643,7 +2644,7 @@ inline struct dir_ent *create_dir_entry(char *name, char *source_name, char *non
 	return dir_ent;
 }
 
-inline void add_dir_entry(struct dir_ent *dir_ent, struct dir_info *sub_dir, struct inode_info *inode_info) {
+static inline void add_dir_entry(struct dir_ent *dir_ent, struct dir_info *sub_dir, struct inode_info *inode_info) {
 	struct dir_info *dir = dir_ent->our_dir;
 
 	if (sub_dir)
@@ -2656,14 +2657,14 @@ inline void add_dir_entry(struct dir_ent *dir_ent, struct dir_info *sub_dir, str
 	dir->count++;
 }
 
-inline void add_dir_entry2(char *name, char *source_name, char *nonstandard_pathname, struct dir_info *sub_dir, struct inode_info *inode_info, struct dir_info *dir) {
+static inline void add_dir_entry2(char *name, char *source_name, char *nonstandard_pathname, struct dir_info *sub_dir, struct inode_info *inode_info, struct dir_info *dir) {
 	struct dir_ent *dir_ent = create_dir_entry(name, source_name,
 											   nonstandard_pathname, dir);
 
 	add_dir_entry(dir_ent, sub_dir, inode_info);
 }
 
-inline void free_dir_entry(struct dir_ent *dir_ent) {
+static inline void free_dir_entry(struct dir_ent *dir_ent) {
 	if (dir_ent->name)
 		free(dir_ent->name);
 
@@ -2673,7 +2674,7 @@ inline void free_dir_entry(struct dir_ent *dir_ent) {
 	free(dir_ent);
 }
 
-inline void add_excluded(struct dir_info *dir) {
+static inline void add_excluded(struct dir_info *dir) {
 	dir->excluded++;
 }
 
@@ -3542,7 +3543,7 @@ void initialise_threads(int readq, int fragq, int bwriteq, int fwriteq, int free
 		BAD_ERROR("Failed to set signal mask in intialise_threads\n");
 
 	if (processors == -1) {
-#ifndef linux
+#ifndef __linux__
 		int mib[2];
 		size_t len = sizeof(processors);
 
@@ -4223,6 +4224,39 @@ void calculate_queue_sizes(int mem, int *readq, int *fragq, int *bwriteq, int *f
 	*fragq = mem - *readq - *bwriteq - *fwriteq;
 }
 
+/*
+ * Takes the compressor, compressor options, block size and flags from the
+ * superblock of an existing filesystem, so that a modified tree can be
+ * repacked the same way as the image it was extracted from
+ */
+void read_like_super(char *image) {
+	struct squashfs_super_block like;
+	int like_fd = open(image, O_RDONLY);
+
+	if (like_fd == -1) {
+		ERROR("Could not open %s because %s\n", image, strerror(errno));
+		exit(1);
+	}
+
+	comp = read_super(like_fd, &like, image);
+	close(like_fd);
+	if (comp == NULL) {
+		ERROR("Failed to read the -like filesystem %s\n", image);
+		exit(1);
+	}
+
+	block_log = slog(block_size = like.block_size);
+	noI = SQUASHFS_UNCOMPRESSED_INODES(like.flags);
+	noD = SQUASHFS_UNCOMPRESSED_DATA(like.flags);
+	noF = SQUASHFS_UNCOMPRESSED_FRAGMENTS(like.flags);
+	noX = SQUASHFS_UNCOMPRESSED_XATTRS(like.flags);
+	no_fragments = SQUASHFS_NO_FRAGMENTS(like.flags);
+	always_use_fragments = SQUASHFS_ALWAYS_FRAGMENTS(like.flags);
+	duplicate_checking = SQUASHFS_DUPLICATES(like.flags);
+	exportable = SQUASHFS_EXPORTABLE(like.flags);
+	no_xattrs = SQUASHFS_NO_XATTRS(like.flags);
+}
+
 #define VERSION() \
 	printf("mksquashfs version 4.3 (2014/05/12)\n");\
 	printf("copyright (C) 2014 Phillip Lougher "\
@@ -4255,6 +4289,7 @@ int main(int argc, char *argv[]) {
 	int progress = TRUE;
 	int force_progress = FALSE;
 	struct file_buffer **fragment = NULL;
+	char *like_image = NULL;
 
 	if (argc > 1 && strcmp(argv[1], "-version") == 0) {
 		VERSION();
@@ -4298,7 +4333,7 @@ int main(int argc, char *argv[]) {
 
 		} else if (strcmp(argv[i], "-e") == 0)
 			break;
-		else if (strcmp(argv[i], "-root-becomes") == 0 || strcmp(argv[i], "-ef") == 0 || strcmp(argv[i], "-pf") == 0 || strcmp(argv[i], "-af") == 0 || strcmp(argv[i], "-comp") == 0)
+		else if (strcmp(argv[i], "-root-becomes") == 0 || strcmp(argv[i], "-ef") == 0 || strcmp(argv[i], "-pf") == 0 || strcmp(argv[i], "-af") == 0 || strcmp(argv[i], "-comp") == 0 || strcmp(argv[i], "-like") == 0)
 			i++;
 	}
 
@@ -4556,6 +4591,12 @@ int main(int argc, char *argv[]) {
 				exit(1);
 			}
 			root_name = argv[i];
+		} else if (strcmp(argv[i], "-like") == 0) {
+			if (++i == argc) {
+				ERROR("%s: -like missing filesystem\n", argv[0]);
+				exit(1);
+			}
+			like_image = argv[i];
 		} else if (strcmp(argv[i], "-version") == 0) {
 			VERSION();
 		} else {
@@ -4583,6 +4624,9 @@ int main(int argc, char *argv[]) {
 			ERROR("-force-uid uid\t\tset all file uids to uid\n");
 			ERROR("-force-gid gid\t\tset all file gids to gid\n");
 			ERROR("-nopad\t\t\tdo not pad filesystem to a multiple " "of 4K\n");
+			ERROR("-like <filesystem>\tuse the compressor, compressor options, block size\n");
+			ERROR("\t\t\tand flags of an existing <filesystem>, overriding\n");
+			ERROR("\t\t\tthe options above\n");
 			ERROR("-keep-as-directory\tif one source directory is " "specified, create a root\n");
 			ERROR("\t\t\tdirectory containing that directory, " "rather than the\n");
 			ERROR("\t\t\tcontents of the directory\n");
@@ -4626,6 +4670,9 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	if (like_image)
+		read_like_super(like_image);
+
 	/*
 	 * Some compressors may need the options to be checked for validity
 	 * once all the options have been processed
@@ -4705,7 +4752,7 @@ int main(int argc, char *argv[]) {
 			process_exclude_file(argv[++i]);
 		else if (strcmp(argv[i], "-e") == 0)
 			break;
-		else if (strcmp(argv[i], "-root-becomes") == 0 || strcmp(argv[i], "-sort") == 0 || strcmp(argv[i], "-pf") == 0 || strcmp(argv[i], "-af") == 0 || strcmp(argv[i], "-comp") == 0)
+		else if (strcmp(argv[i], "-root-becomes") == 0 || strcmp(argv[i], "-sort") == 0 || strcmp(argv[i], "-pf") == 0 || strcmp(argv[i], "-af") == 0 || strcmp(argv[i], "-comp") == 0 || strcmp(argv[i], "-like") == 0)
 			i++;
 
 	if (i != argc) {
@@ -4730,7 +4777,7 @@ int main(int argc, char *argv[]) {
 			sorted++;
 		} else if (strcmp(argv[i], "-e") == 0)
 			break;
-		else if (strcmp(argv[i], "-root-becomes") == 0 || strcmp(argv[i], "-ef") == 0 || strcmp(argv[i], "-pf") == 0 || strcmp(argv[i], "-af") == 0 || strcmp(argv[i], "-comp") == 0)
+		else if (strcmp(argv[i], "-root-becomes") == 0 || strcmp(argv[i], "-ef") == 0 || strcmp(argv[i], "-pf") == 0 || strcmp(argv[i], "-af") == 0 || strcmp(argv[i], "-comp") == 0 || strcmp(argv[i], "-like") == 0)
 			i++;
 
 	if (!delete) {
@@ -31,7 +31,7 @@
 #include <stdio.h>
 #include <string.h>
 
-#if !defined(linux) && !defined(__CYGWIN__)
+#if !defined(__linux__) && !defined(__CYGWIN__)
 #    define __BYTE_ORDER BYTE_ORDER
 #    define __BIG_ENDIAN BIG_ENDIAN
 #    define __LITTLE_ENDIAN LITTLE_ENDIAN
@@ -51,7 +51,7 @@ int read_fragment_table_1(long long *directory_table_end) {
 struct inode *read_inode_1(unsigned int start_block, unsigned int offset) {
 	static union squashfs_inode_header_1 header;
 	long long start = sBlk.s.inode_table_start + start_block;
-	int bytes = lookup_entry(inode_table_hash, start);
+	int bytes = lookup_inode_entry(start, offset + SQUASHFS_METADATA_SIZE);
 	char *block_ptr = inode_table + bytes + offset;
 	static struct inode i;
 
@@ -127,7 +127,7 @@ struct inode *read_inode_1(unsigned int start_block, unsigned int offset) {
 			i.time = inode->mtime;
 			i.blocks = (i.data + sBlk.s.block_size - 1) >> sBlk.s.block_log;
 			i.start = inode->start_block;
-			i.block_ptr = block_ptr + sizeof(*inode);
+			i.block_ptr = inode_table + lookup_inode_entry(start, offset + sizeof(*inode) + i.blocks * sizeof(unsigned short)) + offset + sizeof(*inode);
 			i.fragment = 0;
 			i.frag_bytes = 0;
 			i.offset = 0;
@@ -215,7 +215,7 @@ struct dir *squashfs_opendir_1(unsigned int block_start, unsigned int offset, st
 		return dir;
 
 	start = sBlk.s.directory_table_start + (*i)->start;
-	bytes = lookup_entry(directory_table_hash, start);
+	bytes = lookup_directory_entry(start, (*i)->offset + (*i)->data);
 	if (bytes == -1)
 		EXIT_UNSQUASH("squashfs_opendir: directory block %d not " "found!\n", block_start);
 
@@ -106,7 +106,7 @@ void read_fragment_2(unsigned int fragment, long long *start_block, int *size) {
 struct inode *read_inode_2(unsigned int start_block, unsigned int offset) {
 	static union squashfs_inode_header_2 header;
 	long long start = sBlk.s.inode_table_start + start_block;
-	int bytes = lookup_entry(inode_table_hash, start);
+	int bytes = lookup_inode_entry(start, offset + SQUASHFS_METADATA_SIZE);
 	char *block_ptr = inode_table + bytes + offset;
 	static struct inode i;
 
@@ -181,7 +181,7 @@ struct inode *read_inode_2(unsigned int start_block, unsigned int offset) {
 			i.blocks = inode->fragment == SQUASHFS_INVALID_FRAG ? (i.data + sBlk.s.block_size - 1) >> sBlk.s.block_log : i.data >> sBlk.s.block_log;
 			i.start = inode->start_block;
 			i.sparse = 0;
-			i.block_ptr = block_ptr + sizeof(*inode);
+			i.block_ptr = inode_table + lookup_inode_entry(start, offset + sizeof(*inode) + i.blocks * sizeof(unsigned int)) + offset + sizeof(*inode);
 			break;
 		}
 	case SQUASHFS_SYMLINK_TYPE:{
@@ -95,7 +95,7 @@ void read_fragment_3(unsigned int fragment, long long *start_block, int *size) {
 struct inode *read_inode_3(unsigned int start_block, unsigned int offset) {
 	static union squashfs_inode_header_3 header;
 	long long start = sBlk.s.inode_table_start + start_block;
-	int bytes = lookup_entry(inode_table_hash, start);
+	int bytes = lookup_inode_entry(start, offset + SQUASHFS_METADATA_SIZE);
 	char *block_ptr = inode_table + bytes + offset;
 	static struct inode i;
 
@@ -167,7 +167,7 @@ struct inode *read_inode_3(unsigned int start_block, unsigned int offset) {
 			i.blocks = inode->fragment == SQUASHFS_INVALID_FRAG ? (i.data + sBlk.s.block_size - 1) >> sBlk.s.block_log : i.data >> sBlk.s.block_log;
 			i.start = inode->start_block;
 			i.sparse = 1;
-			i.block_ptr = block_ptr + sizeof(*inode);
+			i.block_ptr = inode_table + lookup_inode_entry(start, offset + sizeof(*inode) + i.blocks * sizeof(unsigned int)) + offset + sizeof(*inode);
 			break;
 		}
 	case SQUASHFS_LREG_TYPE:{
@@ -187,7 +187,7 @@ struct inode *read_inode_3(unsigned int start_block, unsigned int offset) {
 			i.blocks = inode->fragment == SQUASHFS_INVALID_FRAG ? (inode->file_size + sBlk.s.block_size - 1) >> sBlk.s.block_log : inode->file_size >> sBlk.s.block_log;
 			i.start = inode->start_block;
 			i.sparse = 1;
-			i.block_ptr = block_ptr + sizeof(*inode);
+			i.block_ptr = inode_table + lookup_inode_entry(start, offset + sizeof(*inode) + i.blocks * sizeof(unsigned int)) + offset + sizeof(*inode);
 			break;
 		}
 	case SQUASHFS_SYMLINK_TYPE:{
@@ -270,7 +270,7 @@ struct dir *squashfs_opendir_3(unsigned int block_start, unsigned int offset, st
 		return dir;
 
 	start = sBlk.s.directory_table_start + (*i)->start;
-	bytes = lookup_entry(directory_table_hash, start);
+	bytes = lookup_directory_entry(start, (*i)->offset + (*i)->data);
 
 	if (bytes == -1)
 		EXIT_UNSQUASH("squashfs_opendir: directory block %d not " "found!\n", block_start);
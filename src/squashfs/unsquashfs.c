@@ -29,6 +29,9 @@
 #include "compressor.h"
 #include "xattr.h"
 #include "unsquashfs_info.h"
+#include "unsquashfs_dedup.h"
+#include "unsquashfs_tar.h"
+#include "attr_sink.h"
 #include "stdarg.h"
 
 #ifdef __APPLE__
@@ -59,6 +62,7 @@ struct compressor *comp;
 int bytes = 0, swap, file_count = 0, dir_count = 0, sym_count = 0, dev_count = 0, fifo_count = 0;
 char *inode_table = NULL, *directory_table = NULL;
 struct hash_table_entry *inode_table_hash[65536], *directory_table_hash[65536];
+long long directory_table_end;
 int fd;
 unsigned int *uid_table, *guid_table;
 unsigned int cached_frag = SQUASHFS_INVALID_FRAG;
@@ -71,6 +75,7 @@ int lsonly = FALSE, info = FALSE, force = FALSE, short_ls = TRUE;
 int use_regex = FALSE;
 char **created_inode;
 int root_process;
+struct attr_sink *attr_sink = NULL;
 int columns;
 int rotate = 0;
 pthread_mutex_t screen_mutex;
@@ -81,6 +86,15 @@ int inode_number = 1;
 int no_xattrs = XATTR_DEF;
 int user_xattrs = FALSE;
 
+/*
+ * when set, the inode and directory tables are not read upfront, metadata
+ * blocks are instead decompressed on demand by lookup_inode_entry() and
+ * lookup_directory_entry()
+ */
+int lazy_metadata = FALSE;
+int inode_table_size = 0, inode_table_bytes = 0;
+int directory_table_size = 0, directory_table_bytes = 0;
+
 int lookup_type[] = {
 	0,
 	S_IFDIR,
@@ -534,7 +548,7 @@ int print_filename(char *pathname, struct inode *inode) {
 	return 1;
 }
 
-void add_entry(struct hash_table_entry *hash_table[], long long start, int bytes) {
+struct hash_table_entry *add_entry(struct hash_table_entry *hash_table[], long long start, int bytes) {
 	int hash = CALCULATE_HASH(start);
 	struct hash_table_entry *hash_table_entry;
 
@@ -544,20 +558,41 @@ void add_entry(struct hash_table_entry *hash_table[], long long start, int bytes
 
 	hash_table_entry->start = start;
 	hash_table_entry->bytes = bytes;
+	hash_table_entry->run_end = -1;
 	hash_table_entry->next = hash_table[hash];
 	hash_table[hash] = hash_table_entry;
+
+	return hash_table_entry;
 }
 
-int lookup_entry(struct hash_table_entry *hash_table[], long long start) {
+struct hash_table_entry *find_entry(struct hash_table_entry *hash_table[], long long start) {
 	int hash = CALCULATE_HASH(start);
 	struct hash_table_entry *hash_table_entry;
 
 	for (hash_table_entry = hash_table[hash]; hash_table_entry; hash_table_entry = hash_table_entry->next)
 
 		if (hash_table_entry->start == start)
-			return hash_table_entry->bytes;
+			return hash_table_entry;
+
+	return NULL;
+}
+
+int lookup_entry(struct hash_table_entry *hash_table[], long long start) {
+	struct hash_table_entry *hash_table_entry = find_entry(hash_table, start);
+
+	return hash_table_entry ? hash_table_entry->bytes : -1;
+}
+
+void free_hash_table(struct hash_table_entry *hash_table[]) {
+	int i;
 
-	return -1;
+	for (i = 0; i < 65536; i++) {
+		while (hash_table[i]) {
+			struct hash_table_entry *next = hash_table[i]->next;
+			free(hash_table[i]);
+			hash_table[i] = next;
+		}
+	}
 }
 
 int read_fs_bytes(int fd, long long byte, int bytes, void *buff) {
@@ -728,32 +763,119 @@ int read_inode_table(long long start, long long end) {
 	return FALSE;
 }
 
-int set_attributes(char *pathname, int mode, uid_t uid, gid_t guid, time_t time, unsigned int xattr, unsigned int set_mode) {
-	struct utimbuf times = { time, time };
+/*
+ * Decompresses the metadata blocks starting at start into a new run at the
+ * end of table, until length bytes are contiguously available or the end
+ * of the table is reached.  Blocks already present in an earlier run are
+ * read again if that run is too short, the new hash entries shadow the
+ * old ones.
+ */
+int read_metadata_run(char **table, int *size, int *used, struct hash_table_entry *hash_table[], long long start, long long end, int length) {
+	int first = *used, bytes = *used, count = 0, run_end, res, i;
+	struct hash_table_entry **run = NULL;
 
-	write_xattr(pathname, xattr);
+	TRACE("read_metadata_run: start %lld, end %lld, length %d\n", start, end, length);
 
-	if (utime(pathname, &times) == -1) {
-		ERROR("set_attributes: failed to set time on %s, because %s\n", pathname, strerror(errno));
-		return FALSE;
-	}
+	while (start < end && bytes - first < length) {
+		if (*size - bytes < SQUASHFS_METADATA_SIZE) {
+			*table = realloc(*table, *size += SQUASHFS_METADATA_SIZE);
+			if (*table == NULL)
+				EXIT_UNSQUASH("Out of memory in read_metadata_run\n");
+		}
 
-	if (root_process) {
-		if (chown(pathname, uid, guid) == -1) {
-			ERROR("set_attributes: failed to change uid and gids " "on %s, because %s\n", pathname, strerror(errno));
-			return FALSE;
+		if (count % DIR_ENT_SIZE == 0) {
+			run = realloc(run, (count + DIR_ENT_SIZE) * sizeof(struct hash_table_entry *));
+			if (run == NULL)
+				EXIT_UNSQUASH("Out of memory in read_metadata_run\n");
 		}
-	} else
+
+		run[count++] = add_entry(hash_table, start, bytes);
+
+		res = read_block(fd, start, &start, 0, *table + bytes);
+		if (res == 0)
+			EXIT_UNSQUASH("read_metadata_run: failed to read block\n");
+
+		bytes += res;
+	}
+
+	/* a run reaching the end of the table can't be extended further */
+	run_end = start < end ? bytes : -1;
+	for (i = 0; i < count; i++)
+		run[i]->run_end = run_end;
+
+	free(run);
+	*used = bytes;
+	return first;
+}
+
+int lookup_metadata(char **table, int *size, int *used, struct hash_table_entry *hash_table[], long long table_start, long long end, long long start, int length) {
+	struct hash_table_entry *entry = find_entry(hash_table, start);
+
+	if (lazy_metadata == FALSE || (entry && (entry->run_end == -1 || entry->bytes + length <= entry->run_end)))
+		return entry ? entry->bytes : -1;
+
+	if (start < table_start || start >= end)
+		return -1;
+
+	return read_metadata_run(table, size, used, hash_table, start, end, length);
+}
+
+/*
+ * Returns the position in inode_table of the metadata block at start,
+ * guaranteeing length bytes from the block start are contiguous
+ */
+int lookup_inode_entry(long long start, int length) {
+	return lookup_metadata(&inode_table, &inode_table_size, &inode_table_bytes, inode_table_hash, sBlk.s.inode_table_start, sBlk.s.directory_table_start, start, length);
+}
+
+/*
+ * Returns the position in directory_table of the metadata block at start,
+ * guaranteeing length bytes from the block start are contiguous
+ */
+int lookup_directory_entry(long long start, int length) {
+	return lookup_metadata(&directory_table, &directory_table_size, &directory_table_bytes, directory_table_hash, sBlk.s.directory_table_start, directory_table_end, start, length);
+}
+
+void free_metadata() {
+	free_hash_table(inode_table_hash);
+	free_hash_table(directory_table_hash);
+	free(inode_table);
+	free(directory_table);
+	inode_table = directory_table = NULL;
+	inode_table_size = inode_table_bytes = 0;
+	directory_table_size = directory_table_bytes = 0;
+}
+
+/*
+ * Records the attributes of pathname, they are applied once the whole
+ * tree has been written by set_deferred_attributes()
+ */
+int set_attributes(char *pathname, int mode, uid_t uid, gid_t guid, time_t time, unsigned int xattr, unsigned int set_mode) {
+	int flags = ATTR_TIME, entry;
+
+	if (root_process)
+		flags |= ATTR_OWNER;
+	else
 		mode &= ~07000;
 
-	if ((set_mode || (mode & 07000)) && chmod(pathname, (mode_t) mode) == -1) {
-		ERROR("set_attributes: failed to change mode %s, because %s\n", pathname, strerror(errno));
+	if (set_mode || (mode & 07000))
+		flags |= ATTR_MODE;
+
+	entry = attr_sink_add(attr_sink, pathname, flags, (mode_t) mode, uid, guid, time);
+	if (entry == -1)
 		return FALSE;
-	}
+
+	write_xattr(pathname, entry, xattr);
 
 	return TRUE;
 }
 
+static void set_deferred_attributes() {
+	attr_sink_apply(attr_sink, processors);
+	attr_sink_free(attr_sink);
+	attr_sink = NULL;
+}
+
 int write_bytes(int fd, char *buff, int bytes) {
 	int res, count;
 
@@ -857,8 +979,33 @@ void queue_file(char *pathname, int file_fd, struct inode *inode) {
 	file->time = inode->time;
 	file->pathname = strdup(pathname);
 	file->blocks = inode->blocks + (inode->frag_bytes > 0);
+	/* holes have to be written out in a tar archive */
+	file->sparse = tar_fd == -1 ? inode->sparse : FALSE;
+	file->xattr = inode->xattr;
+	file->dup = NULL;
+	file->typeflag = TAR_REGTYPE;
+	file->link = NULL;
+	queue_put(to_writer, file);
+}
+
+void queue_duplicate(char *pathname, struct inode *inode, struct dedup_entry *dup) {
+	struct squashfs_file *file = malloc(sizeof(struct squashfs_file));
+	if (file == NULL)
+		EXIT_UNSQUASH("queue_duplicate: unable to malloc file\n");
+
+	file->fd = -1;
+	file->file_size = inode->data;
+	file->mode = inode->mode;
+	file->gid = inode->gid;
+	file->uid = inode->uid;
+	file->time = inode->time;
+	file->pathname = strdup(pathname);
+	file->blocks = inode->blocks + (inode->frag_bytes > 0);
 	file->sparse = inode->sparse;
 	file->xattr = inode->xattr;
+	file->dup = dup;
+	file->typeflag = TAR_REGTYPE;
+	file->link = NULL;
 	queue_put(to_writer, file);
 }
 
@@ -874,6 +1021,34 @@ void queue_dir(char *pathname, struct dir *dir) {
 	file->time = dir->mtime;
 	file->pathname = strdup(pathname);
 	file->xattr = dir->xattr;
+	file->dup = NULL;
+	file->typeflag = TAR_DIRTYPE;
+	file->link = NULL;
+	queue_put(to_writer, file);
+}
+
+/*
+ * Queues the tar header of an inode without data.  Going through the
+ * writer thread keeps it in order with the regular files
+ */
+void queue_tar(char *pathname, struct inode *inode, char typeflag, char *link) {
+	struct squashfs_file *file = malloc(sizeof(struct squashfs_file));
+	if (file == NULL)
+		EXIT_UNSQUASH("queue_tar: unable to malloc file\n");
+
+	file->fd = -1;
+	file->file_size = 0;
+	file->blocks = 0;
+	file->mode = inode->mode;
+	file->gid = inode->gid;
+	file->uid = inode->uid;
+	file->time = inode->time;
+	file->pathname = strdup(pathname);
+	file->xattr = inode->xattr;
+	file->dup = NULL;
+	file->typeflag = typeflag;
+	file->link = link ? strdup(link) : NULL;
+	file->rdev = inode->data;
 	queue_put(to_writer, file);
 }
 
@@ -885,18 +1060,38 @@ int write_file(struct inode *inode, char *pathname) {
 
 	TRACE("write_file: regular file, blocks %d\n", inode->blocks);
 
-	file_fd = open_wait(pathname, O_CREAT | O_WRONLY | (force ? O_TRUNC : 0), (mode_t) inode->mode & 0777);
-	if (file_fd == -1) {
-		ERROR("write_file: failed to create file %s, because %s\n", pathname, strerror(errno));
-		return FALSE;
-	}
-
 	block_list = malloc(inode->blocks * sizeof(unsigned int));
 	if (block_list == NULL)
 		EXIT_UNSQUASH("write_file: unable to malloc block list\n");
 
 	s_ops.read_block_list(block_list, inode->block_ptr, inode->blocks);
 
+	/*
+	 * if another file with the same data has already been queued, let
+	 * the writer thread materialise this one from it instead of reading
+	 * and decompressing the same blocks again
+	 */
+	if (dedup_mode != DEDUP_NONE && tar_fd == -1 && inode->data) {
+		struct dedup_entry *dup = dedup_add(inode, block_list, pathname);
+
+		if (dup) {
+			TRACE("write_file: %s is a duplicate of %s\n", pathname, dup->pathname);
+			queue_duplicate(pathname, inode, dup);
+			free(block_list);
+			return TRUE;
+		}
+	}
+
+	if (tar_fd != -1)
+		file_fd = tar_fd;
+	else
+		file_fd = open_wait(pathname, O_CREAT | O_WRONLY | (force ? O_TRUNC : 0), FILE_CREATE_MODE(inode->mode));
+	if (file_fd == -1) {
+		ERROR("write_file: failed to create file %s, because %s\n", pathname, strerror(errno));
+		free(block_list);
+		return FALSE;
+	}
+
 	/*
 	 * the writer thread is queued a squashfs_file structure describing the
 	 * file.  If the file has one or more blocks or a fragment they are
@@ -939,11 +1134,55 @@ int write_file(struct inode *inode, char *pathname) {
 	return TRUE;
 }
 
+/*
+ * tar output counterpart of create_inode() for the inodes without data
+ */
+int create_tar_inode(char *pathname, struct inode *i) {
+	switch (i->type) {
+	case SQUASHFS_SYMLINK_TYPE:
+	case SQUASHFS_LSYMLINK_TYPE:
+		queue_tar(pathname, i, TAR_SYMTYPE, i->symlink);
+		sym_count++;
+		break;
+	case SQUASHFS_BLKDEV_TYPE:
+	case SQUASHFS_LBLKDEV_TYPE:
+		queue_tar(pathname, i, TAR_BLKTYPE, NULL);
+		dev_count++;
+		break;
+	case SQUASHFS_CHRDEV_TYPE:
+	case SQUASHFS_LCHRDEV_TYPE:
+		queue_tar(pathname, i, TAR_CHRTYPE, NULL);
+		dev_count++;
+		break;
+	case SQUASHFS_FIFO_TYPE:
+	case SQUASHFS_LFIFO_TYPE:
+		queue_tar(pathname, i, TAR_FIFOTYPE, NULL);
+		fifo_count++;
+		break;
+	case SQUASHFS_SOCKET_TYPE:
+	case SQUASHFS_LSOCKET_TYPE:
+		ERROR("create_inode: socket %s ignored\n", pathname);
+		break;
+	default:
+		ERROR("Unknown inode type %d in create_tar_inode!\n", i->type);
+		return FALSE;
+	}
+
+	created_inode[i->inode_number - 1] = strdup(pathname);
+
+	return TRUE;
+}
+
 int create_inode(char *pathname, struct inode *i) {
 	TRACE("create_inode: pathname %s\n", pathname);
 
 	if (created_inode[i->inode_number - 1]) {
 		TRACE("create_inode: hard link\n");
+		if (tar_fd != -1) {
+			queue_tar(pathname, i, TAR_LNKTYPE, created_inode[i->inode_number - 1]);
+			return TRUE;
+		}
+
 		if (force)
 			unlink(pathname);
 
@@ -955,6 +1194,9 @@ int create_inode(char *pathname, struct inode *i) {
 		return TRUE;
 	}
 
+	if (tar_fd != -1 && i->type != SQUASHFS_FILE_TYPE && i->type != SQUASHFS_LREG_TYPE)
+		return create_tar_inode(pathname, i);
+
 	switch (i->type) {
 	case SQUASHFS_FILE_TYPE:
 	case SQUASHFS_LREG_TYPE:
@@ -975,12 +1217,7 @@ int create_inode(char *pathname, struct inode *i) {
 			break;
 		}
 
-		write_xattr(pathname, i->xattr);
-
-		if (root_process) {
-			if (lchown(pathname, i->uid, i->gid) == -1)
-				ERROR("create_inode: failed to change " "uid and gids on %s, because " "%s\n", pathname, strerror(errno));
-		}
+		write_xattr(pathname, attr_sink_add(attr_sink, pathname, root_process ? ATTR_OWNER : 0, i->mode, i->uid, i->gid, i->time), i->xattr);
 
 		sym_count++;
 		break;
@@ -1358,7 +1595,9 @@ void dir_scan(char *parent_name, unsigned int start_block, unsigned int offset,
 	if (lsonly || info)
 		print_filename(parent_name, i);
 
-	if (!lsonly) {
+	if (!lsonly && tar_fd != -1)
+		queue_tar(parent_name, i, TAR_DIRTYPE, NULL);
+	else if (!lsonly) {
 		/*
 		 * Make directory with default User rwx permissions rather than
 		 * the permissions from the filesystem, as these may not have
@@ -1422,7 +1661,7 @@ void dir_scan(char *parent_name, unsigned int start_block, unsigned int offset,
 		free_subdir(new);
 	}
 
-	if (!lsonly)
+	if (!lsonly && tar_fd == -1)
 		queue_dir(parent_name, dir);
 
 	squashfs_closedir(dir);
@@ -1766,6 +2005,23 @@ void *writer(void *arg) {
 		if (file == NULL) {
 			queue_put(from_writer, NULL);
 			continue;
+		} else if (file->dup != NULL) {
+			/* file->pathname shares its data with an earlier file */
+			if (write_duplicate(file) == FALSE) {
+				ERROR("Failed to write %s, skipping\n", file->pathname);
+				unlink(file->pathname);
+			}
+			cur_blocks += file->blocks;
+			free(file->pathname);
+			free(file);
+			continue;
+		} else if (file->fd == -1 && tar_fd != -1) {
+			/* tar entry without data */
+			tar_write_header(file);
+			free(file->pathname);
+			free(file->link);
+			free(file);
+			continue;
 		} else if (file->fd == -1) {
 			/* write attributes for directory file->pathname */
 			set_attributes(file->pathname, file->mode, file->uid, file->gid, file->time, file->xattr, TRUE);
@@ -1778,6 +2034,9 @@ void *writer(void *arg) {
 
 		file_fd = file->fd;
 
+		if (tar_fd != -1)
+			tar_write_header(file);
+
 		for (i = 0; i < file->blocks; i++, cur_blocks++) {
 			struct file_entry *block = queue_get(to_writer);
 
@@ -1792,12 +2051,22 @@ void *writer(void *arg) {
 			if (block->buffer->error)
 				failed = TRUE;
 
+			if (failed && tar_fd != -1) {
+				/* the archive needs file_size bytes whatever happens */
+				hole += block->size;
+				cache_block_put(block->buffer);
+				free(block);
+				continue;
+			}
+
 			if (failed)
 				continue;
 
 			error = write_block(file_fd, block->buffer->data + block->offset, block->size, hole, file->sparse);
 
 			if (error == FALSE) {
+				if (tar_fd != -1)
+					EXIT_UNSQUASH("writer: failed to write the tar archive\n");
 				ERROR("writer: failed to write data block %d\n", i);
 				failed = TRUE;
 			}
@@ -1807,7 +2076,7 @@ void *writer(void *arg) {
 			free(block);
 		}
 
-		if (hole && failed == FALSE) {
+		if (hole && (failed == FALSE || tar_fd != -1)) {
 			/*
 			 * corner case for hole extending to end of file
 			 */
@@ -1820,6 +2089,8 @@ void *writer(void *arg) {
 				 */
 				hole--;
 				if (write_block(file_fd, "\0", 1, hole, file->sparse) == FALSE) {
+					if (tar_fd != -1)
+						EXIT_UNSQUASH("writer: failed to write the tar archive\n");
 					ERROR("writer: failed to write sparse " "data block\n");
 					failed = TRUE;
 				}
@@ -1829,12 +2100,18 @@ void *writer(void *arg) {
 			}
 		}
 
-		close_wake(file_fd);
-		if (failed == FALSE)
-			set_attributes(file->pathname, file->mode, file->uid, file->gid, file->time, file->xattr, force);
-		else {
-			ERROR("Failed to write %s, skipping\n", file->pathname);
-			unlink(file->pathname);
+		if (tar_fd != -1) {
+			tar_pad(file->file_size);
+			if (failed)
+				ERROR("Failed to read %s, zeroed in the archive\n", file->pathname);
+		} else {
+			close_wake(file_fd);
+			if (failed == FALSE)
+				set_attributes(file->pathname, file->mode, file->uid, file->gid, file->time, file->xattr, force || FILE_MODE_WIDENED(file->mode));
+			else {
+				ERROR("Failed to write %s, skipping\n", file->pathname);
+				unlink(file->pathname);
+			}
 		}
 		free(file->pathname);
 		free(file);
@@ -1928,7 +2205,7 @@ void initialise_threads(int fragment_buffer_size, int data_buffer_size) {
 		EXIT_UNSQUASH("Failed to set signal mask in initialise_threads" "\n");
 
 	if (processors == -1) {
-#if !defined(linux) && !defined(__CYGWIN__)
+#if !defined(__linux__) && !defined(__CYGWIN__)
 		int mib[2];
 		size_t len = sizeof(processors);
 
@@ -2264,15 +2541,22 @@ int is_squashfs(char *filename) {
 	return result;
 }
 
-int unsquashfs(char *squashfs, char *dest) {
+/*
+ * Opens the filesystem and reads the tables needed for extraction.
+ * Unless lazy_metadata is set, the whole inode and directory tables are
+ * read in too
+ */
+void squashfs_open(char *squashfs) {
 	int stat_sys = FALSE;
-	struct pathnames *paths = NULL;
-	struct pathname *path = NULL;
-	long long directory_table_end;
 	int fragment_buffer_size = FRAGMENT_BUFFER_DEFAULT;
 	int data_buffer_size = DATA_BUFFER_DEFAULT;
 
 	pthread_mutex_init(&screen_mutex, NULL);
+	attr_sink_free(attr_sink);
+	attr_sink = attr_sink_new();
+	if (attr_sink == NULL)
+		EXIT_UNSQUASH("Out of memory in squashfs_open\n");
+
 	root_process = geteuid() == 0;
 	if (root_process)
 		umask(0);
@@ -2362,17 +2646,43 @@ int unsquashfs(char *squashfs, char *dest) {
 	if (s_ops.read_fragment_table(&directory_table_end) == FALSE)
 		EXIT_UNSQUASH("failed to read fragment table\n");
 
-	if (read_inode_table(sBlk.s.inode_table_start, sBlk.s.directory_table_start) == FALSE)
-		EXIT_UNSQUASH("failed to read inode table\n");
+	/* drop the tables of a previously extracted filesystem */
+	free_metadata();
+	dedup_reset();
+
+	if (!lazy_metadata) {
+		if (read_inode_table(sBlk.s.inode_table_start, sBlk.s.directory_table_start) == FALSE)
+			EXIT_UNSQUASH("failed to read inode table\n");
 
-	if (read_directory_table(sBlk.s.directory_table_start, directory_table_end) == FALSE)
-		EXIT_UNSQUASH("failed to read directory table\n");
+		if (read_directory_table(sBlk.s.directory_table_start, directory_table_end) == FALSE)
+			EXIT_UNSQUASH("failed to read directory table\n");
+	}
 
 	if (no_xattrs)
 		sBlk.s.xattr_id_table_start = SQUASHFS_INVALID_BLK;
 
 	if (read_xattrs_from_disk(fd, &sBlk.s) == 0)
 		EXIT_UNSQUASH("failed to read the xattr table\n");
+}
+
+void print_summary() {
+	if (!lsonly) {
+		printf("\n");
+		printf("created %d files\n", file_count);
+		printf("created %d directories\n", dir_count);
+		printf("created %d symlinks\n", sym_count);
+		printf("created %d devices\n", dev_count);
+		printf("created %d fifos\n", fifo_count);
+	}
+}
+
+int unsquashfs(char *squashfs, char *dest) {
+	struct pathnames *paths = NULL;
+	struct pathname *path = NULL;
+
+	lazy_metadata = FALSE;
+	squashfs_open(squashfs);
+	tar_set_root(dest);
 
 	if (path) {
 		paths = init_subdir();
@@ -2395,14 +2705,135 @@ int unsquashfs(char *squashfs, char *dest) {
 
 	disable_progress_bar();
 
-	if (!lsonly) {
-		printf("\n");
-		printf("created %d files\n", file_count);
-		printf("created %d directories\n", dir_count);
-		printf("created %d symlinks\n", sym_count);
-		printf("created %d devices\n", dev_count);
-		printf("created %d fifos\n", fifo_count);
+	set_deferred_attributes();
+
+	print_summary();
+
+	return 0;
+}
+
+/*
+ * Resolves pathname (relative to the filesystem root) reading only the
+ * directories along it, and returns the location and type of the inode it
+ * refers to
+ */
+int squashfs_lookup(char *pathname, unsigned int *start_block, unsigned int *offset, unsigned int *type) {
+	char *target = pathname, *targname, *name;
+	unsigned int ent_start, ent_offset, ent_type;
+	struct inode *i;
+	struct dir *dir;
+	int found;
+
+	*start_block = SQUASHFS_INODE_BLK(sBlk.s.root_inode);
+	*offset = SQUASHFS_INODE_OFFSET(sBlk.s.root_inode);
+	*type = SQUASHFS_DIR_TYPE;
+
+	while (*target == '/')
+		target++;
+
+	while (*target != '\0') {
+		target = get_component(target, &targname);
+
+		if (strcmp(targname, ".") == 0) {
+			free(targname);
+			continue;
+		}
+
+		if (*type != SQUASHFS_DIR_TYPE || (dir = s_ops.squashfs_opendir(*start_block, *offset, &i)) == NULL) {
+			free(targname);
+			return FALSE;
+		}
+
+		found = FALSE;
+		while (squashfs_readdir(dir, &name, &ent_start, &ent_offset, &ent_type)) {
+			if (strcmp(name, targname) == 0) {
+				found = TRUE;
+				break;
+			}
+		}
+
+		squashfs_closedir(dir);
+		free(targname);
+
+		if (!found)
+			return FALSE;
+
+		*start_block = ent_start;
+		*offset = ent_offset;
+		*type = ent_type;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Extracts a single file or directory tree out of the filesystem.  Only the
+ * metadata blocks along pathname and the data and fragment blocks of the
+ * matching files are read and decompressed
+ */
+int unsquashfs_path(char *squashfs, char *dest, char *pathname) {
+	unsigned int start_block, offset, type;
+	char *target, *targname, *dest_path, *new_path;
+	struct inode *i, leading_dir;
+	int res;
+
+	lazy_metadata = TRUE;
+	squashfs_open(squashfs);
+	tar_set_root(dest);
+
+	if (squashfs_lookup(pathname, &start_block, &offset, &type) == FALSE) {
+		ERROR("%s not found in %s\n", pathname, squashfs);
+		return 1;
+	}
+
+	/*
+	 * recreate the leading directories of pathname under dest, these get
+	 * default permissions as their inodes are never read
+	 */
+	dest_path = strdup(dest);
+	if (dest_path == NULL)
+		EXIT_UNSQUASH("Out of memory in unsquashfs_path\n");
+
+	memset(&leading_dir, 0, sizeof(leading_dir));
+	leading_dir.mode = S_IFDIR | S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+	leading_dir.time = sBlk.s.mkfs_time;
+	leading_dir.xattr = SQUASHFS_INVALID_XATTR;
+
+	for (target = get_component(pathname, &targname); *targname != '\0'; target = get_component(target, &targname)) {
+		if (tar_fd != -1)
+			queue_tar(dest_path, &leading_dir, TAR_DIRTYPE, NULL);
+		else if (mkdir(dest_path, leading_dir.mode) == -1 && errno != EEXIST)
+			EXIT_UNSQUASH("unsquashfs_path: failed to make directory %s, because %s\n", dest_path, strerror(errno));
+
+		res = asprintf(&new_path, "%s/%s", dest_path, targname);
+		if (res == -1)
+			EXIT_UNSQUASH("asprintf failed in unsquashfs_path\n");
+
+		free(dest_path);
+		free(targname);
+		dest_path = new_path;
 	}
+	free(targname);
+
+	TRACE("unsquashfs_path: %s -> %s, type %d\n", pathname, dest_path, type);
+
+	if (type == SQUASHFS_DIR_TYPE)
+		dir_scan(dest_path, start_block, offset, NULL);
+	else {
+		i = s_ops.read_inode(start_block, offset);
+		create_inode(dest_path, i);
+
+		if (i->type == SQUASHFS_SYMLINK_TYPE || i->type == SQUASHFS_LSYMLINK_TYPE)
+			free(i->symlink);
+	}
+
+	queue_put(to_writer, NULL);
+	queue_get(from_writer);
+
+	set_deferred_attributes();
+
+	print_summary();
 
+	free(dest_path);
 	return 0;
 }
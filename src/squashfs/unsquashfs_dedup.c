@@ -0,0 +1,240 @@
+/*
+ * Duplicate file detection for unsquashfs.
+ *
+ * Squashfs stores the data of duplicate files only once, every copy
+ * pointing at the same blocks and fragment.  Such files are detected here
+ * so that their data is decompressed and written only for the first one,
+ * the others being materialised from it by the writer thread.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * unsquashfs_dedup.c
+ */
+
+#include "unsquashfs.h"
+#include "unsquashfs_dedup.h"
+
+#ifdef __linux__
+#    include <linux/fs.h>
+#endif
+
+#define DEDUP_INITIAL_SIZE 1024
+
+extern int force;
+extern unsigned int block_size;
+
+int dedup_mode = DEDUP_DEFAULT;
+
+static struct dedup_entry **dedup_table = NULL;
+static int dedup_size = 0, dedup_count = 0;
+
+int dedup_parse_mode(const char *name) {
+	if (strcmp(name, "none") == 0)
+		return DEDUP_NONE;
+	if (strcmp(name, "clone") == 0)
+		return DEDUP_CLONE;
+	if (strcmp(name, "copy") == 0)
+		return DEDUP_COPY;
+	if (strcmp(name, "link") == 0)
+		return DEDUP_LINK;
+	return -1;
+}
+
+static unsigned long long hash_block_list(unsigned int *block_list, int blocks) {
+	/* FNV-1a */
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	int i;
+
+	for (i = 0; i < blocks; i++) {
+		hash ^= block_list[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static unsigned int dedup_hash(long long start, long long file_size, unsigned int fragment, int offset, unsigned long long list_hash) {
+	unsigned long long hash = list_hash;
+
+	hash ^= start + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+	hash ^= file_size + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+	hash ^= ((unsigned long long)fragment << 32 | (unsigned int)offset) + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+
+	return hash ^ (hash >> 32);
+}
+
+/*
+ * Doubles the number of buckets, keeping the chains short however many
+ * files the filesystem holds
+ */
+static void dedup_grow() {
+	int new_size = dedup_size ? dedup_size * 2 : DEDUP_INITIAL_SIZE, i;
+	struct dedup_entry **new_table = calloc(new_size, sizeof(struct dedup_entry *));
+
+	if (new_table == NULL)
+		EXIT_UNSQUASH("Out of memory in dedup_grow\n");
+
+	for (i = 0; i < dedup_size; i++) {
+		struct dedup_entry *entry = dedup_table[i], *next;
+
+		for (; entry; entry = next) {
+			unsigned int hash = dedup_hash(entry->start, entry->file_size, entry->fragment, entry->offset, entry->list_hash) & (new_size - 1);
+
+			next = entry->next;
+			entry->next = new_table[hash];
+			new_table[hash] = entry;
+		}
+	}
+
+	free(dedup_table);
+	dedup_table = new_table;
+	dedup_size = new_size;
+}
+
+void dedup_reset() {
+	int i;
+
+	for (i = 0; i < dedup_size; i++) {
+		while (dedup_table[i]) {
+			struct dedup_entry *next = dedup_table[i]->next;
+
+			free(dedup_table[i]->pathname);
+			free(dedup_table[i]);
+			dedup_table[i] = next;
+		}
+	}
+
+	free(dedup_table);
+	dedup_table = NULL;
+	dedup_size = dedup_count = 0;
+}
+
+/*
+ * Looks up a file with the same data as inode.  If one was already seen
+ * it is returned, otherwise inode is recorded under pathname and NULL is
+ * returned.  Called by the main thread only
+ */
+struct dedup_entry *dedup_add(struct inode *inode, unsigned int *block_list, char *pathname) {
+	unsigned long long list_hash = hash_block_list(block_list, inode->blocks);
+	unsigned int fragment = inode->frag_bytes ? inode->fragment : SQUASHFS_INVALID_FRAG;
+	int offset = inode->frag_bytes ? inode->offset : 0;
+	struct dedup_entry *entry;
+	unsigned int hash;
+
+	if (dedup_count >= dedup_size)
+		dedup_grow();
+
+	hash = dedup_hash(inode->start, inode->data, fragment, offset, list_hash) & (dedup_size - 1);
+
+	for (entry = dedup_table[hash]; entry; entry = entry->next)
+		if (entry->start == inode->start && entry->file_size == inode->data && entry->fragment == fragment && entry->offset == offset && entry->list_hash == list_hash)
+			return entry;
+
+	entry = malloc(sizeof(struct dedup_entry));
+	if (entry == NULL)
+		EXIT_UNSQUASH("Out of memory in dedup_add\n");
+
+	entry->start = inode->start;
+	entry->file_size = inode->data;
+	entry->fragment = fragment;
+	entry->offset = offset;
+	entry->list_hash = list_hash;
+	entry->pathname = strdup(pathname);
+	entry->mode = inode->mode;
+	entry->uid = inode->uid;
+	entry->gid = inode->gid;
+	entry->time = inode->time;
+	entry->xattr = inode->xattr;
+	entry->next = dedup_table[hash];
+	dedup_table[hash] = entry;
+	dedup_count++;
+
+	return NULL;
+}
+
+static int copy_data(int in_fd, int out_fd) {
+	char buffer[block_size];
+	ssize_t res;
+
+#ifdef __linux__
+	while ((res = copy_file_range(in_fd, NULL, out_fd, NULL, 1 << 30, 0)) > 0) ;
+
+	if (res == 0)
+		return TRUE;
+
+	/* not supported by the kernel or across these filesystems */
+	if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP)
+		return FALSE;
+
+	if (lseek(in_fd, 0, SEEK_SET) == -1 || lseek(out_fd, 0, SEEK_SET) == -1)
+		return FALSE;
+#endif
+
+	while ((res = read(in_fd, buffer, block_size)) > 0) {
+		if (write_bytes(out_fd, buffer, res) == -1)
+			return FALSE;
+	}
+
+	return res == 0;
+}
+
+/*
+ * Writer thread side: materialises file->pathname from the already
+ * written file->dup->pathname.  Queue ordering guarantees that file has
+ * been completely written and closed
+ */
+int write_duplicate(struct squashfs_file *file) {
+	struct dedup_entry *dup = file->dup;
+	int in_fd, out_fd, res;
+
+	TRACE("write_duplicate: %s duplicate of %s\n", file->pathname, dup->pathname);
+
+	if (dedup_mode == DEDUP_LINK && dup->mode == file->mode && dup->uid == file->uid && dup->gid == file->gid && dup->time == file->time && dup->xattr == file->xattr) {
+		if (force)
+			unlink(file->pathname);
+
+		if (link(dup->pathname, file->pathname) == 0)
+			return TRUE;
+
+		/* fall back to a separate copy, e.g. if the link count is exhausted */
+	}
+
+	in_fd = open(dup->pathname, O_RDONLY);
+	if (in_fd == -1) {
+		ERROR("write_duplicate: failed to open %s, because %s\n", dup->pathname, strerror(errno));
+		return FALSE;
+	}
+
+	out_fd = open_wait(file->pathname, O_CREAT | O_WRONLY | (force ? O_TRUNC : 0), FILE_CREATE_MODE(file->mode));
+	if (out_fd == -1) {
+		ERROR("write_duplicate: failed to create file %s, because %s\n", file->pathname, strerror(errno));
+		close(in_fd);
+		return FALSE;
+	}
+
+	res = FALSE;
+#ifdef FICLONE
+	if (dedup_mode != DEDUP_COPY)
+		res = ioctl(out_fd, FICLONE, in_fd) == 0;
+#endif
+	if (res == FALSE)
+		res = copy_data(in_fd, out_fd);
+
+	close(in_fd);
+	close_wake(out_fd);
+
+	if (res == FALSE) {
+		ERROR("write_duplicate: failed to copy %s to %s, because %s\n", dup->pathname, file->pathname, strerror(errno));
+		return FALSE;
+	}
+
+	return set_attributes(file->pathname, file->mode, file->uid, file->gid, file->time, file->xattr, force || FILE_MODE_WIDENED(file->mode));
+}
@@ -0,0 +1,317 @@
+/*
+ * Tar output for unsquashfs.
+ *
+ * Instead of creating the files on disk, the writer thread streams them
+ * as a POSIX (pax) tar archive straight from the decompressed blocks.
+ * Ownership, modes, device nodes and xattrs are stored as found in the
+ * filesystem, so this needs neither root privileges nor fakeroot.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * unsquashfs_tar.c
+ */
+
+#include "unsquashfs.h"
+#include "xattr.h"
+#include "unsquashfs_tar.h"
+
+extern int user_xattrs;
+
+int tar_fd = -1;
+
+/* length of the leading directories of the destination, not archived */
+static int tar_strip = 0;
+
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+/* pax extended header records */
+struct pax {
+	char *data;
+	int len;
+	int size;
+};
+
+/*
+ * Opens the archive, dest being a file (or fifo) name, or "-" for
+ * stdout.  Returns the archive file descriptor or -1
+ */
+int tar_output(char *dest) {
+	if (strcmp(dest, "-") == 0) {
+		/*
+		 * the archive takes over stdout, everything printed from now
+		 * on (including what is still buffered) goes to stderr
+		 */
+		tar_fd = dup(STDOUT_FILENO);
+		if (tar_fd != -1 && dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+			close(tar_fd);
+			tar_fd = -1;
+		}
+	} else
+		tar_fd = open(dest, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+
+	return tar_fd;
+}
+
+/*
+ * Archive names are the pathnames relative to the directory dest would
+ * have been created in, so that extracting the archive gives the same
+ * tree as extracting the filesystem
+ */
+void tar_set_root(char *dest) {
+	char *slash = strrchr(dest, '/');
+
+	tar_strip = slash ? slash - dest + 1 : 0;
+}
+
+static void tar_write(void *buffer, int size) {
+	if (write_bytes(tar_fd, buffer, size) == -1)
+		EXIT_UNSQUASH("Failed to write the tar archive\n");
+}
+
+/* Pads the data of an entry to a whole number of tar blocks */
+void tar_pad(long long size) {
+	char zero[TAR_BLOCK_SIZE];
+	int pad = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+
+	if (pad) {
+		memset(zero, 0, pad);
+		tar_write(zero, pad);
+	}
+}
+
+static int tar_octal(char *field, int width, unsigned long long value) {
+	if (value >> (3 * (width - 1)))
+		return FALSE;
+
+	snprintf(field, width, "%0*llo", width - 1, value);
+	return TRUE;
+}
+
+static void pax_add(struct pax *pax, char *key, void *value, int vlen) {
+	int rlen = strlen(key) + vlen + 3, len = rlen + 1, digits;
+	char num[16];
+
+	/* the record length counts its own digits */
+	while ((digits = snprintf(num, sizeof(num), "%d", len)) + rlen != len)
+		len = rlen + digits;
+
+	if (pax->len + len > pax->size) {
+		pax->size = (pax->len + len) * 2;
+		pax->data = realloc(pax->data, pax->size);
+		if (pax->data == NULL)
+			EXIT_UNSQUASH("Out of memory in pax_add\n");
+	}
+
+	pax->len += sprintf(pax->data + pax->len, "%d %s=", len, key);
+	memcpy(pax->data + pax->len, value, vlen);
+	pax->len += vlen;
+	pax->data[pax->len++] = '\n';
+}
+
+static void pax_add_number(struct pax *pax, char *key, long long value) {
+	char num[24];
+
+	pax_add(pax, key, num, snprintf(num, sizeof(num), "%lld", value));
+}
+
+static void tar_set_name(struct tar_header *header, struct pax *pax, char *name) {
+	int len = strlen(name);
+	char *split;
+
+	if (len <= sizeof(header->name)) {
+		memcpy(header->name, name, len);
+		return;
+	}
+
+	/* ustar can split a long name at a '/' between prefix and name */
+	for (split = strchr(name, '/'); split && split - name <= sizeof(header->prefix); split = strchr(split + 1, '/')) {
+		if (split != name && len - (split - name) - 1 <= sizeof(header->name) && split[1] != '\0') {
+			memcpy(header->prefix, name, split - name);
+			memcpy(header->name, split + 1, len - (split - name) - 1);
+			return;
+		}
+	}
+
+	pax_add(pax, "path", name, len);
+	memcpy(header->name, name, sizeof(header->name));
+}
+
+static void tar_xattrs(struct pax *pax, unsigned int xattr) {
+#ifdef XATTR_SUPPORT
+	struct xattr_list *xattr_list;
+	unsigned int count;
+	int i;
+
+	if (xattr == SQUASHFS_INVALID_XATTR || sBlk.s.xattr_id_table_start == SQUASHFS_INVALID_BLK)
+		return;
+
+	xattr_list = get_xattr(xattr, &count, 1);
+	if (xattr_list == NULL) {
+		ERROR("tar_xattrs: failed to read xattrs\n");
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		char *key;
+
+		if (user_xattrs && (xattr_list[i].type & SQUASHFS_XATTR_PREFIX_MASK) != SQUASHFS_XATTR_USER)
+			continue;
+
+		if (asprintf(&key, "SCHILY.xattr.%s", xattr_list[i].full_name) == -1)
+			EXIT_UNSQUASH("asprintf failed in tar_xattrs\n");
+		pax_add(pax, key, xattr_list[i].value, xattr_list[i].vsize);
+		free(key);
+	}
+
+	free_xattr(xattr_list, count);
+#endif
+}
+
+static void tar_checksum(struct tar_header *header) {
+	unsigned char *bytes = (unsigned char *)header;
+	unsigned int sum = 0;
+	int i;
+
+	memset(header->chksum, ' ', sizeof(header->chksum));
+	for (i = 0; i < sizeof(struct tar_header); i++)
+		sum += bytes[i];
+
+	snprintf(header->chksum, sizeof(header->chksum), "%06o", sum);
+}
+
+static void tar_write_pax(struct tar_header *header, struct pax *pax, char *name) {
+	struct tar_header xheader;
+	int len = strlen(name);
+	char *base;
+
+	/* the base name is enough, readers ignore the name of pax headers */
+	if (len > 1 && name[len - 1] == '/')
+		len--;
+	for (base = name + len; base > name && base[-1] != '/'; base--) ;
+
+	memset(&xheader, 0, sizeof(xheader));
+	snprintf(xheader.name, sizeof(xheader.name), "PaxHeaders/%.*s", (int)(name + len - base), base);
+	tar_octal(xheader.mode, sizeof(xheader.mode), 0644);
+	tar_octal(xheader.uid, sizeof(xheader.uid), 0);
+	tar_octal(xheader.gid, sizeof(xheader.gid), 0);
+	tar_octal(xheader.size, sizeof(xheader.size), pax->len);
+	memcpy(xheader.mtime, header->mtime, sizeof(xheader.mtime));
+	xheader.typeflag = TAR_XHDTYPE;
+	memcpy(xheader.magic, "ustar", 6);
+	memcpy(xheader.version, "00", 2);
+	tar_checksum(&xheader);
+
+	tar_write(&xheader, sizeof(xheader));
+	tar_write(pax->data, pax->len);
+	tar_pad(pax->len);
+}
+
+/*
+ * Writes the header of file, preceded by a pax extended header if
+ * anything doesn't fit in the ustar fields.  Regular file data follows,
+ * written by the writer thread and padded with tar_pad()
+ */
+void tar_write_header(struct squashfs_file *file) {
+	struct tar_header header;
+	struct pax pax = { NULL, 0, 0 };
+	long long size = file->typeflag == TAR_REGTYPE ? file->file_size : 0;
+	char *name, *link = file->link;
+
+	memset(&header, 0, sizeof(header));
+
+	if (asprintf(&name, "%s%s", file->pathname + tar_strip, file->typeflag == TAR_DIRTYPE ? "/" : "") == -1)
+		EXIT_UNSQUASH("asprintf failed in tar_write_header\n");
+	tar_set_name(&header, &pax, name);
+
+	if (link) {
+		int len;
+
+		if (file->typeflag == TAR_LNKTYPE)
+			link += tar_strip;
+
+		len = strlen(link);
+		if (len > sizeof(header.linkname)) {
+			pax_add(&pax, "linkpath", link, len);
+			len = sizeof(header.linkname);
+		}
+		memcpy(header.linkname, link, len);
+	}
+
+	tar_octal(header.mode, sizeof(header.mode), file->mode & 07777);
+	if (!tar_octal(header.uid, sizeof(header.uid), file->uid)) {
+		pax_add_number(&pax, "uid", file->uid);
+		tar_octal(header.uid, sizeof(header.uid), 0);
+	}
+	if (!tar_octal(header.gid, sizeof(header.gid), file->gid)) {
+		pax_add_number(&pax, "gid", file->gid);
+		tar_octal(header.gid, sizeof(header.gid), 0);
+	}
+	if (!tar_octal(header.size, sizeof(header.size), size)) {
+		pax_add_number(&pax, "size", size);
+		tar_octal(header.size, sizeof(header.size), 0);
+	}
+	if (file->time < 0 || !tar_octal(header.mtime, sizeof(header.mtime), file->time)) {
+		pax_add_number(&pax, "mtime", file->time);
+		tar_octal(header.mtime, sizeof(header.mtime), 0);
+	}
+
+	header.typeflag = file->typeflag;
+	memcpy(header.magic, "ustar", 6);
+	memcpy(header.version, "00", 2);
+
+	if (file->typeflag == TAR_CHRTYPE || file->typeflag == TAR_BLKTYPE) {
+		tar_octal(header.devmajor, sizeof(header.devmajor), (file->rdev >> 8) & 0xff);
+		tar_octal(header.devminor, sizeof(header.devminor), file->rdev & 0xff);
+	}
+
+	tar_xattrs(&pax, file->xattr);
+
+	if (pax.len)
+		tar_write_pax(&header, &pax, name);
+
+	tar_checksum(&header);
+	tar_write(&header, sizeof(header));
+
+	free(pax.data);
+	free(name);
+}
+
+/* Ends the archive with two zero blocks */
+void tar_close() {
+	char end[TAR_BLOCK_SIZE * 2];
+
+	if (tar_fd == -1)
+		return;
+
+	memset(end, 0, sizeof(end));
+	tar_write(end, sizeof(end));
+
+	close(tar_fd);
+	tar_fd = -1;
+}
@@ -24,23 +24,22 @@
 
 #include "unsquashfs.h"
 #include "xattr.h"
-
-#include <sys/xattr.h>
-
-#define NOSPACE_MAX 10
+#include "attr_sink.h"
 
 extern int root_process;
 extern int user_xattrs;
 
-void write_xattr(char *pathname, unsigned int xattr) {
+/*
+ * Adds the xattrs to the attributes of pathname recorded as entry, to be
+ * written once the whole tree has been extracted
+ */
+void write_xattr(char *pathname, int entry, unsigned int xattr) {
 	unsigned int count;
 	struct xattr_list *xattr_list;
 	int i;
 	static int nonsuper_error = FALSE;
-	static int ignore_xattrs = FALSE;
-	static int nospace_error = 0;
 
-	if (ignore_xattrs || xattr == SQUASHFS_INVALID_XATTR || sBlk.s.xattr_id_table_start == SQUASHFS_INVALID_BLK)
+	if (entry == -1 || xattr == SQUASHFS_INVALID_XATTR || sBlk.s.xattr_id_table_start == SQUASHFS_INVALID_BLK)
 		return;
 
 	xattr_list = get_xattr(xattr, &count, 1);
@@ -56,41 +55,8 @@ void write_xattr(char *pathname, unsigned int xattr) {
 			continue;
 
 		if (root_process || prefix == SQUASHFS_XATTR_USER) {
-			int res = lsetxattr(pathname, xattr_list[i].full_name,
-								xattr_list[i].value, xattr_list[i].vsize, 0);
-
-			if (res == -1) {
-				if (errno == ENOTSUP) {
-					/*
-					 * If the destination filesystem cannot
-					 * suppport xattrs, print error, and
-					 * disable xattr output as this error is
-					 * unlikely to go away, and printing
-					 * screenfulls of the same error message
-					 * is rather annoying
-					 */
-					ERROR("write_xattr: failed to write " "xattr %s for file %s because " "extended attributes are not " "supported by the destination " "filesystem\n", xattr_list[i].full_name, pathname);
-					ERROR("Ignoring xattrs in " "filesystem\n");
-					ERROR("To avoid this error message, " "specify -no-xattrs\n");
-					ignore_xattrs = TRUE;
-				} else if ((errno == ENOSPC || errno == EDQUOT)
-						   && nospace_error < NOSPACE_MAX) {
-					/*
-					 * Many filesystems like ext2/3/4 have
-					 * limits on the amount of xattr
-					 * data that can be stored per file
-					 * (typically one block or 4K), so
-					 * we shouldn't disable xattr ouput,
-					 * as the error may be restriced to one
-					 * file only.  If we get a lot of these
-					 * then suppress the error messsage
-					 */
-					ERROR("write_xattr: failed to write " "xattr %s for file %s because " "no extended attribute space " "remaining (per file or " "filesystem limit)\n", xattr_list[i].full_name, pathname);
-					if (++nospace_error == NOSPACE_MAX)
-						ERROR("%d of these errors " "printed, further error " "messages of this type " "are suppressed!\n", NOSPACE_MAX);
-				} else
-					ERROR("write_xattr: failed to write " "xattr %s for file %s because " "%s\n", xattr_list[i].full_name, pathname, strerror(errno));
-			}
+			if (attr_sink_xattr(attr_sink, entry, xattr_list[i].full_name, xattr_list[i].value, xattr_list[i].vsize) == -1)
+				ERROR("write_xattr: failed to record xattr %s " "for file %s\n", xattr_list[i].full_name, pathname);
 		} else if (nonsuper_error == FALSE) {
 			/*
 			 * if extract user xattrs only then
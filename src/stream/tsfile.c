@@ -5,15 +5,49 @@
 #include <string.h>
 #include <inttypes.h>
 #include <openssl/aes.h>
+#include <openssl/evp.h>
 
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/param.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "config.h"
 #include "stream/crc32.h"
+#include "mfile.h"
+#include "thpool.h"
 #include "util.h"
+#include "util_memscan.h"
 
 #define TS_PACKET_SIZE 192
+#define TS_OUT_SIZE (TS_PACKET_SIZE - 4)
+/* packets converted per batch, about 3MB of output */
+#define TS_BATCH_PACKETS 16384
+/* packets decrypted by each task of the pool */
+#define TS_TASK_PACKETS 1024
+
+struct tables {
+	int number[8192];
+	unsigned char type[8192];
+	int pcr_count[8192];
+	int packets[8192];
+};
+
+/*
+ * Seek index written next to the TS file (see tsfile.h). Offsets are the
+ * byte offsets of packets in the TS file, PCRs are in 27MHz units
+ */
+struct ts_index {
+	FILE *fh;
+	int64_t interval;
+	int64_t last_pcr[8192];
+};
+
 static AES_KEY AESkey;
+/* the content key, for the EVP contexts of the pool */
+static uint8_t contentKey[16];
 
 static int setKey(char *keyPath) {
 	int ret = -1;
@@ -86,165 +120,483 @@ static int setKey(char *keyPath) {
 		}
 		puts("\n");
 		
-		AES_set_decrypt_key(unwrapped_key, 128, &AESkey);
+		memcpy(contentKey, unwrapped_key, sizeof(contentKey));
 	} else {
-		AES_set_decrypt_key(aes_key, 128, &AESkey);
+		memcpy(contentKey, aes_key, sizeof(contentKey));
 	}
 	
 	return 0;
 }
 
-void convertSTR2TS_internal(char *inFilename, char *outFilename, int notOverwrite) {
-	FILE *inFile = fopen(inFilename, "rb");
-	if (inFile == NULL) {
-		printf("Can't open file %s\n", inFilename);
+/*
+ * Offset of the first packet at or after off whose sync byte is followed by
+ * two more, a packet apart, before end. Returns -1 if there's none
+ */
+static int64_t find_sync(const uint8_t *data, uint64_t off, uint64_t end) {
+	if (off + 4 >= end)
+		return -1;
+
+	size_t len = end - off - 4;
+	size_t sync = memfind_sync(data + off + 4, len, 0x47, TS_PACKET_SIZE, 3);
+	return (sync < len) ? (int64_t)(off + sync) : -1;
+}
+
+/* Number of packets from in, up to count, that are in sync */
+static size_t sync_run(const uint8_t *in, size_t count) {
+	size_t n;
+
+	for (n = 0; n < count && in[n * TS_PACKET_SIZE + 4] == 0x47; n++) ;
+	return n;
+}
+
+struct decrypt_batch {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int pending;
+};
+
+struct decrypt_work {
+	const uint8_t *in;
+	uint8_t *out;
+	size_t count;
+	struct decrypt_batch *batch;
+};
+
+/* One STR file, converted into its own range of the TS file */
+struct ts_part {
+	MFILE *in;
+	int64_t start;		// first packet in sync, -1 if there's none
+	int header;		// the PAT and PMT go first
+	uint64_t offset;	// of the range of the part in the TS file
+	uint64_t size;		// of the range, at least that of the part
+	uint64_t written;	// size of the part, once converted
+	int outFile;
+	const char *outFilename;
+	struct tables PIDs;
+	FILE *idx;		// where the index entries of the part go
+	char *idxData;		// the entries, for parts indexed in memory
+	size_t idxLen;
+};
+
+/* decrypts the packets of all the parts being converted */
+static threadpool pool = NULL;
+
+/*
+ * Copies count packets from in to out without their 4-byte prefix,
+ * decrypting the scrambled ones
+ */
+static void decrypt_packets(struct decrypt_work *work) {
+	const uint8_t *in = work->in;
+	uint8_t *out = work->out;
+	size_t n;
+	int outl;
+
+	// each 16-byte block is decrypted on its own (ECB)
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if (ctx == NULL || !EVP_DecryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, contentKey, NULL)) {
+		fprintf(stderr, "Can't initialize AES decryption\n");
+		EVP_CIPHER_CTX_free(ctx);
 		return;
 	}
+	EVP_CIPHER_CTX_set_padding(ctx, 0);
 
-	fseeko(inFile, 0, SEEK_END);
-	uint64_t filesize = ftello(inFile);
-	rewind(inFile);
+	for (n = 0; n < work->count; n++, in += TS_PACKET_SIZE, out += TS_OUT_SIZE) {
+		memcpy(out, in + 4, TS_OUT_SIZE);
+		int offset = 8;
+		if ((in[7] & 0xC0) == 0xC0 || (in[7] & 0xC0) == 0x80) {	// decrypt only scrambled packets
+			if (in[7] & 0x20)
+				offset += (in[8] + 1);	// skip adaption field
+			out[3] &= 0x3F;	// remove scrambling bits
+			if (offset > TS_PACKET_SIZE)
+				offset = TS_PACKET_SIZE;	//application will crash without this check when file is corrupted
+			int len = (TS_PACKET_SIZE - offset) & ~0xF;
+			if (len > 0)
+				EVP_DecryptUpdate(ctx, out + offset - 4, &outl, in + offset, len);
+		};
+	}
 
-	FILE *outFile;
-	if (notOverwrite)
-		outFile = fopen(outFilename, "a+b");
-	else
-		outFile = fopen(outFilename, "wb");
+	EVP_CIPHER_CTX_free(ctx);
+}
 
-	if (outFile == NULL) {
-		printf("Can't open file %s\n", outFilename);
+static void decrypt_task(struct decrypt_work *work) {
+	decrypt_packets(work);
+
+	pthread_mutex_lock(&work->batch->lock);
+	if (--work->batch->pending == 0)
+		pthread_cond_signal(&work->batch->done);
+	pthread_mutex_unlock(&work->batch->lock);
+}
+
+static int64_t read_pcr(const uint8_t *p) {
+	int64_t base = ((int64_t)p[0] << 25) | (p[1] << 17) | (p[2] << 9) | (p[3] << 1) | (p[4] >> 7);
+	return base * 300 + (((p[4] & 1) << 8) | p[5]);
+}
+
+/* Adds the PCR to the index if it's at least interval past the last one */
+static void index_pcr(struct ts_index *idx, int pid, int64_t pcr, uint64_t offset) {
+	int64_t last = idx->last_pcr[pid];
+
+	// the first PCR, or a discontinuity or wrap around
+	if (last < 0 || pcr < last || pcr - last >= idx->interval) {
+		fprintf(idx->fh, "pcr %04x %" PRId64 " %" PRIu64 "\n", pid, pcr, offset);
+		idx->last_pcr[pid] = pcr;
+	}
+}
+
+/*
+ * Updates the PID statistics with count converted packets, and the index
+ * if there's one. offset is the offset of the first packet in the TS file
+ */
+static void count_packets(const uint8_t *out, size_t count, struct tables *PIDs, struct ts_index *idx, uint64_t offset) {
+	size_t n;
+
+	for (n = 0; n < count; n++, out += TS_OUT_SIZE, offset += TS_OUT_SIZE) {
+		int pid = (out[1] << 8 | out[2]) & 0x1FFF;
+		PIDs->packets[pid]++;
+		// Search PCR
+		if (out[3] & 0x20) {	// adaptation field exists
+			if (out[5] & 0x10)	// check if PCR exists
+				PIDs->pcr_count[pid]++;
+			if (idx && out[4] >= 7 && (out[5] & 0x10))
+				index_pcr(idx, pid, read_pcr(out + 6), offset);
+			if (idx && out[4] >= 1 && (out[5] & 0x40))	// random access indicator
+				fprintf(idx->fh, "rai %04x %" PRIu64 "\n", pid, offset);
+		}
+		// Count PES packets only
+		if (out[4] == 0 && out[5] == 0 && out[6] == 1) {
+			PIDs->number[pid]++;
+			PIDs->type[pid] = out[7];
+		}
+	}
+}
+
+/*
+ * Opens the index of the TS file outFilename, appending to it with append.
+ * Returns NULL if there's to be no index
+ */
+static FILE *index_open(const char *outFilename, int append) {
+	if (config_opts.ts_index_interval <= 0)
+		return NULL;
+
+	char *idxFilename;
+	asprintf(&idxFilename, "%s.idx", outFilename);
+
+	FILE *fh = fopen(idxFilename, append ? "a" : "w");
+	if (fh == NULL)
+		printf("Can't open file %s\n", idxFilename);
+	else if (!append)
+		fprintf(fh, "# TS index: pcr PID PCR(27MHz) OFFSET, rai PID OFFSET, pid PID packets N pes N pcr N\n");
+
+	free(idxFilename);
+	return fh;
+}
+
+static struct ts_index *index_new(FILE *fh) {
+	if (fh == NULL)
+		return NULL;
+
+	struct ts_index *idx = calloc(1, sizeof(struct ts_index));
+	idx->fh = fh;
+	idx->interval = (int64_t)config_opts.ts_index_interval * 27000;
+	memset(idx->last_pcr, 0xFF, sizeof(idx->last_pcr));
+	return idx;
+}
+
+/* Ends the index with the packet counts of the PIDs of this part */
+static void index_end(struct ts_index *idx, struct tables *PIDs) {
+	int i;
+
+	if (idx == NULL)
 		return;
+
+	for (i = 0; i < 8192; i++) {
+		if (PIDs->packets[i] > 0)
+			fprintf(idx->fh, "pid %04x packets %d pes %d pcr %d\n", i, PIDs->packets[i], PIDs->number[i], PIDs->pcr_count[i]);
+	}
+	free(idx);
+}
+
+/*
+ * Converts count packets from in to out, splitting them across the pool.
+ * Tasks write disjoint parts of out, so the output stays in order
+ */
+static void convert_packets(const uint8_t *in, uint8_t *out, size_t count) {
+	struct decrypt_work work[TS_BATCH_PACKETS / TS_TASK_PACKETS];
+	struct decrypt_batch batch;
+	size_t first;
+	int i, nwork = 0;
+
+	if (pool == NULL || count < TS_TASK_PACKETS * 2) {
+		struct decrypt_work single = { in, out, count, NULL };
+		decrypt_packets(&single);
+		return;
+	}
+
+	for (first = 0; first < count; first += TS_TASK_PACKETS) {
+		work[nwork].in = in + first * TS_PACKET_SIZE;
+		work[nwork].out = out + first * TS_OUT_SIZE;
+		work[nwork].count = MIN(count - first, TS_TASK_PACKETS);
+		work[nwork].batch = &batch;
+		nwork++;
 	}
 
-	unsigned char inBuf[TS_PACKET_SIZE * 10];
-	unsigned char outBuf[TS_PACKET_SIZE];
-	unsigned int k, rounds;
-	int syncFound = 0, j;
-	fread(inBuf, 1, sizeof(inBuf), inFile);
+	// other parts share the pool, so wait for this batch only
+	pthread_mutex_init(&batch.lock, NULL);
+	pthread_cond_init(&batch.done, NULL);
+	batch.pending = nwork;
+	for (i = 0; i < nwork; i++)
+		thpool_add_work(pool, (void *)decrypt_task, &work[i]);
 
+	pthread_mutex_lock(&batch.lock);
+	while (batch.pending > 0)
+		pthread_cond_wait(&batch.done, &batch.lock);
+	pthread_mutex_unlock(&batch.lock);
+	pthread_mutex_destroy(&batch.lock);
+	pthread_cond_destroy(&batch.done);
+}
+
+static int pwrite_all(int fd, const uint8_t *buf, size_t len, uint64_t offset) {
+	while (len > 0) {
+		ssize_t written = pwrite(fd, buf, len, offset);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += written;
+		len -= written;
+		offset += written;
+	}
+	return 0;
+}
+
+static int part_open(struct ts_part *part, const char *inFilename, int header) {
+	part->in = mopen(inFilename, O_RDONLY);
+	if (part->in == NULL) {
+		printf("Can't open file %s\n", inFilename);
+		return -1;
+	}
+
+	part->start = find_sync(mdata(part->in, uint8_t), 0, MIN(msize(part->in), TS_PACKET_SIZE * 10));
+	part->header = header;
+	return 0;
+}
+
+static void part_close(struct ts_part *part) {
+	mclose(part->in);
+	free(part->idxData);
+	free(part);
+}
+
+/*
+ * Largest size the part can take in the TS file. The packets converted
+ * don't overlap in the STR file, so there are no more than fit after the
+ * first one; the size is exact unless sync is lost
+ */
+static uint64_t part_max_size(struct ts_part *part) {
+	uint64_t size = part->header ? TS_OUT_SIZE * 2 : 0;
+
+	if (part->start >= 0)
+		size += (msize(part->in) - part->start) / TS_PACKET_SIZE * TS_OUT_SIZE;
+	return size;
+}
+
+/* Converts the part into its range of the TS file */
+static void part_convert(struct ts_part *part) {
+	const uint8_t *data = mdata(part->in, uint8_t);
+	uint64_t filesize = msize(part->in);
+
+	// packets are converted in batches, straight from the mapping into outBuf
+	uint8_t *outBuf = malloc(TS_OUT_SIZE * TS_BATCH_PACKETS);
+	size_t outLen = 0;
+
+	// offset in the TS file of what's in outBuf
+	uint64_t outOffset = part->offset;
+	struct ts_index *idx = index_new(part->idx);
+
+	int64_t pos = part->start;
+	if (part->header) {
+		if (pos >= 0) {
+			// Construct PAT
+			memset(outBuf, 0xFF, TS_OUT_SIZE * 2);
+			unsigned char PAT[21] = { 0x47, 0x40, 0x00, 0x10, 0x00, 0x00, 0xB0, 0x0D, 0x00, 0x06, 0xC7, 0x00, 0x00, 0x00, 0x01,
+				0xE0, 0xB1, 0xA2, 0x89, 0x69, 0x78
+			};
+			memcpy(outBuf, &PAT, sizeof(PAT));
+
+			// Allocate PMT, the second packet is left as 0xFF
+			outLen = TS_OUT_SIZE * 2;
+		} else {
+			// the PMT is still written at 0xBC
+			outOffset += TS_OUT_SIZE * 2;
+		}
+	}
+
+	while (pos >= 0 && pos + TS_PACKET_SIZE <= filesize) {
+		size_t count = MIN((filesize - pos) / TS_PACKET_SIZE, TS_BATCH_PACKETS - outLen / TS_OUT_SIZE);
+		size_t done = sync_run(data + pos, count);
+
+		convert_packets(data + pos, outBuf + outLen, done);
+		// PID statistics for the PMT are taken in order, after decryption
+		count_packets(outBuf + outLen, done, &part->PIDs, idx, outOffset + outLen);
+
+		pos += done * TS_PACKET_SIZE;
+		outLen += done * TS_OUT_SIZE;
+		if (outLen == TS_OUT_SIZE * TS_BATCH_PACKETS) {
+			if (pwrite_all(part->outFile, outBuf, outLen, outOffset) < 0)
+				break;
+			outOffset += outLen;
+			outLen = 0;
+		}
+
+		if (done < count) {
+			printf("\nLost sync at offset %" PRIx64 "\n", pos);
+			pos = find_sync(data, pos + 1, filesize);
+		}
+	}
+
+	if (pwrite_all(part->outFile, outBuf, outLen, outOffset) < 0)
+		printf("Can't write file %s (%s)\n", part->outFilename, strerror(errno));
+	part->written = outOffset + outLen - part->offset;
+
+	index_end(idx, &part->PIDs);
+	free(outBuf);
+}
+
+/* Moves len bytes of fd from offset from down to offset to */
+static int move_range(int fd, uint64_t from, uint64_t to, uint64_t len) {
+	uint8_t *buf = malloc(TS_OUT_SIZE * TS_BATCH_PACKETS);
+	int ret = 0;
+
+	while (len > 0) {
+		ssize_t got = pread(fd, buf, MIN(len, TS_OUT_SIZE * TS_BATCH_PACKETS), from);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0 || pwrite_all(fd, buf, got, to) < 0) {
+			ret = -1;
+			break;
+		}
+		from += got;
+		to += got;
+		len -= got;
+	}
+
+	free(buf);
+	return ret;
+}
+
+/*
+ * Appends the index entries of a part to idx, with their offsets moved by
+ * shift if the part was moved
+ */
+static void index_append(FILE *idx, const char *data, size_t len, int64_t shift) {
+	const char *line = data, *end = data + len;
+
+	if (shift == 0) {
+		fwrite(data, 1, len, idx);
+		return;
+	}
+
+	// data is NUL terminated by open_memstream()
+	while (line < end) {
+		const char *nl = memchr(line, '\n', end - line);
+		size_t n = (nl ? nl + 1 : end) - line;
+		unsigned int pid;
+		int64_t pcr;
+		uint64_t offset;
+
+		if (sscanf(line, "pcr %x %" SCNd64 " %" SCNu64, &pid, &pcr, &offset) == 3)
+			fprintf(idx, "pcr %04x %" PRId64 " %" PRIu64 "\n", pid, pcr, offset + shift);
+		else if (sscanf(line, "rai %x %" SCNu64, &pid, &offset) == 2)
+			fprintf(idx, "rai %04x %" PRIu64 "\n", pid, offset + shift);
+		else
+			fwrite(line, 1, n, idx);
+		line += n;
+	}
+}
+
+/* Fills in the PMT placeholder at 0xBC from the PIDs of the first part */
+static void write_pmt(int outFile, const char *outFilename, struct tables *PIDs) {
+	unsigned char outBuf[TS_OUT_SIZE];
 	uint64_t i;
-	struct tables {
-		int number[8192];
-		unsigned char type[8192];
-		int pcr_count[8192];
+
+	// Fill PMT
+	memset(outBuf, 0xFF, TS_OUT_SIZE);
+	unsigned char PMT[31] = { 0x47, 0x40, 0xB1, 0x10, 0x00, 0x02, 0xB0,
+		0x17,				// section length in bytes including crc
+		0x00, 0x01,			// program number
+		0xC1, 0x00, 0x00,
+		0xE4, 0x7E,			// PCR PID
+		0xF0, 0x00,			// Program info length
+		0x1B,				// stream type ITU_T_H264
+		0xE4, 0x7E,			// PID
+		0xF0, 0x00,			// ES info length
+		0x04,				// stream type ISO/IEC 13818-3 Audio (MPEG-2)
+		0xE4, 0x7F,			// PID
+		0xF0, 0x00,			// ES info length
+		0xFF, 0xFF, 0xFF, 0xFF	// crc32
 	};
 
-	struct tables PIDs;
-	memset(&PIDs, 0, sizeof(PIDs));
-	int PATnotWritten = 0;
-	for (i = 0; i < (sizeof(inBuf) - TS_PACKET_SIZE * 2); i++) {
-		if (inBuf[i] == 0x47 && inBuf[i + TS_PACKET_SIZE] == 0x47 && inBuf[i + TS_PACKET_SIZE * 2] == 0x47) {
-			fseeko(inFile, i - 4, SEEK_SET);
-			for (i = 0; i < filesize; i += TS_PACKET_SIZE) {
-				fread(inBuf, 1, TS_PACKET_SIZE, inFile);
-				if (inBuf[4] != 0x47) {
-					printf("\nLost sync at offset %" PRIx64 "\n", i);
-					fseeko(inFile, i, SEEK_SET);
-					syncFound = 0;
-					while (syncFound == 0) {
-						if (fread(inBuf, 1, sizeof(inBuf), inFile) < sizeof(inBuf))
-							break;	//prevent infinite loop at end of file
-						for (j = 0; j < (sizeof(inBuf) - TS_PACKET_SIZE); j++) {
-							if (inBuf[j] == 0x47 && inBuf[j + TS_PACKET_SIZE] == 0x47 && inBuf[j + TS_PACKET_SIZE * 2] == 0x47) {
-								syncFound = 1;
-								fseeko(inFile, i + j, SEEK_SET);
-								break;
-							}
-						}
-						i += sizeof(inBuf);
-					}
-				} else {
-					if (!notOverwrite && !PATnotWritten) {
-						// Construct PAT
-						memset(outBuf, 0xFF, TS_PACKET_SIZE);
-						unsigned char PAT[21] = { 0x47, 0x40, 0x00, 0x10, 0x00, 0x00, 0xB0, 0x0D, 0x00, 0x06, 0xC7, 0x00, 0x00, 0x00, 0x01,
-							0xE0, 0xB1, 0xA2, 0x89, 0x69, 0x78
-						};
-						memcpy(outBuf, &PAT, sizeof(PAT));
-						fwrite(outBuf, 1, TS_PACKET_SIZE - 4, outFile);
-
-						// Allocate PMT
-						memset(outBuf, 0xFF, TS_PACKET_SIZE);
-						fwrite(outBuf, 1, TS_PACKET_SIZE - 4, outFile);
-						PATnotWritten = 1;
-					}
-					memcpy(outBuf, inBuf, TS_PACKET_SIZE);
-					int offset = 8;
-					if ((inBuf[7] & 0xC0) == 0xC0 || (inBuf[7] & 0xC0) == 0x80) {	// decrypt only scrambled packets
-						if (inBuf[7] & 0x20)
-							offset += (inBuf[8] + 1);	// skip adaption field
-						outBuf[7] &= 0x3F;	// remove scrambling bits
-						if (offset > TS_PACKET_SIZE)
-							offset = TS_PACKET_SIZE;	//application will crash without this check when file is corrupted
-						rounds = (TS_PACKET_SIZE - offset) / 0x10;
-						for (k = 0; k < rounds; k++)
-							AES_decrypt(inBuf + offset + k * 0x10, outBuf + offset + k * 0x10, &AESkey);	// AES CBC
-					};
-
-					// Search PCR
-					if (inBuf[7] & 0x20) {	// adaptation field exists
-						if (outBuf[9] & 0x10)	// check if PCR exists
-							PIDs.pcr_count[(inBuf[5] << 8 | inBuf[6]) & 0x1FFF]++;
-					}
-					// Count PES packets only
-					if (!notOverwrite && outBuf[8] == 0 && outBuf[9] == 0 && outBuf[10] == 1) {
-						PIDs.number[(inBuf[5] << 8 | inBuf[6]) & 0x1FFF]++;
-						PIDs.type[(inBuf[5] << 8 | inBuf[6]) & 0x1FFF] = outBuf[11];
-					}
-					fwrite(outBuf + 4, 1, TS_PACKET_SIZE - 4, outFile);
-				}
+	for (i = 0; i < 8192; i++)
+		if (PIDs->number[i] > 0) {
+			//printf("PID %zX : %d Type: %zX PCRs: %zX\n", i, PIDs->number[i], PIDs->type[i], PIDs->pcr_count[i]);
+			if (PIDs->pcr_count[i] > 0) {	// Set PCR PID
+				PMT[13] = ((i >> 8) & 0xff) + 0xE0;
+				PMT[14] = i & 0xff;
+			}
+			//Fill video stream PID (0xE0-0xEF)
+			if (PIDs->type[i] >= 0xE0 && PIDs->type[i] <= 0xEF) {
+				PMT[18] = ((i >> 8) & 0xff) + 0xE0;
+				PMT[19] = i & 0xff;
+			}
+			//Fill audio stream PID (0xC0-0xDF)
+			if (PIDs->type[i] >= 0xC0 && PIDs->type[i] <= 0xDF) {
+				PMT[23] = ((i >> 8) & 0xff) + 0xE0;
+				PMT[24] = i & 0xff;
 			}
-			break;
 		}
+	// Set CRC32
+	uint32_t crc = str_crc32(&PMT[5], PMT[7] - 1);
+	PMT[27] = (crc >> 24) & 0xff;
+	PMT[28] = (crc >> 16) & 0xff;
+	PMT[29] = (crc >> 8) & 0xff;
+	PMT[30] = crc & 0xff;
+	memcpy(outBuf, &PMT, sizeof(PMT));
+	if (pwrite(outFile, outBuf, TS_OUT_SIZE, 0xBC) != TS_OUT_SIZE)
+		printf("Can't write file %s (%s)\n", outFilename, strerror(errno));
+}
+
+void convertSTR2TS_internal(char *inFilename, char *outFilename, int notOverwrite) {
+	struct ts_part *part = calloc(1, sizeof(struct ts_part));
+	if (part_open(part, inFilename, !notOverwrite) < 0) {
+		free(part);
+		return;
 	}
-	fclose(inFile);
-	if (!notOverwrite) {
-		// Fill PMT
-		memset(outBuf, 0xFF, TS_PACKET_SIZE);
-		unsigned char PMT[31] = { 0x47, 0x40, 0xB1, 0x10, 0x00, 0x02, 0xB0,
-			0x17,				// section length in bytes including crc
-			0x00, 0x01,			// program number
-			0xC1, 0x00, 0x00,
-			0xE4, 0x7E,			// PCR PID
-			0xF0, 0x00,			// Program info length
-			0x1B,				// stream type ITU_T_H264
-			0xE4, 0x7E,			// PID
-			0xF0, 0x00,			// ES info length
-			0x04,				// stream type ISO/IEC 13818-3 Audio (MPEG-2)
-			0xE4, 0x7F,			// PID
-			0xF0, 0x00,			// ES info length
-			0xFF, 0xFF, 0xFF, 0xFF	// crc32
-		};
 
-		for (i = 0; i < 8192; i++)
-			if (PIDs.number[i] > 0) {
-				//printf("PID %zX : %d Type: %zX PCRs: %zX\n", i, PIDs.number[i], PIDs.type[i], PIDs.pcr_count[i]);
-				if (PIDs.pcr_count[i] > 0) {	// Set PCR PID
-					PMT[13] = ((i >> 8) & 0xff) + 0xE0;
-					PMT[14] = i & 0xff;
-				}
-				//Fill video stream PID (0xE0-0xEF)
-				if (PIDs.type[i] >= 0xE0 && PIDs.type[i] <= 0xEF) {
-					PMT[18] = ((i >> 8) & 0xff) + 0xE0;
-					PMT[19] = i & 0xff;
-				}
-				//Fill audio stream PID (0xC0-0xDF)
-				if (PIDs.type[i] >= 0xC0 && PIDs.type[i] <= 0xDF) {
-					PMT[23] = ((i >> 8) & 0xff) + 0xE0;
-					PMT[24] = i & 0xff;
-				}
-			}
-		// Set CRC32
-		uint32_t crc = str_crc32(&PMT[5], PMT[7] - 1);
-		PMT[27] = (crc >> 24) & 0xff;
-		PMT[28] = (crc >> 16) & 0xff;
-		PMT[29] = (crc >> 8) & 0xff;
-		PMT[30] = crc & 0xff;
-		memcpy(outBuf, &PMT, sizeof(PMT));
-		fseek(outFile, 0xBC, SEEK_SET);
-		fwrite(outBuf, 1, TS_PACKET_SIZE - 4, outFile);
+	int outFile = open(outFilename, O_WRONLY | O_CREAT | (notOverwrite ? 0 : O_TRUNC), 0666);
+	if (outFile < 0) {
+		printf("Can't open file %s\n", outFilename);
+		part_close(part);
+		return;
 	}
-	fclose(outFile);
+
+	part->outFile = outFile;
+	part->outFilename = outFilename;
+	part->offset = notOverwrite ? lseek(outFile, 0, SEEK_END) : 0;
+	part->idx = index_open(outFilename, notOverwrite);
+
+	pool = thpool_init(sysconf(_SC_NPROCESSORS_ONLN));
+	part_convert(part);
+	thpool_destroy(pool);
+	pool = NULL;
+
+	if (!notOverwrite)
+		write_pmt(outFile, outFilename, &part->PIDs);
+
+	if (part->idx)
+		fclose(part->idx);
+	close(outFile);
+	part_close(part);
 }
 
 /* Transport Stream Header (or 4-byte prefix) consists of 32-bit:
@@ -280,17 +632,10 @@ void convertSTR2TS(char *inFilename, int notOverwrite) {
 }
 
 void processPIF(const char *filename, char *dest_file) {
-	FILE *file = fopen(filename, "r");
-	if (file == NULL) {
+	MFILE *pif = mopen(filename, O_RDONLY);
+	if (pif == NULL) {
 		err_exit("Can't open file %s\n", filename);
 	}
-	
-	struct stat statBuf;
-	if(stat(filename, &statBuf) < 0){
-		err_exit("stat() failed for %s\n", filename);
-	}
-	
-	size_t filesize = statBuf.st_size;
 
 	char *baseDir = my_dirname(filename);
 	
@@ -298,29 +643,96 @@ void processPIF(const char *filename, char *dest_file) {
 	asprintf(&keyPath, "%s/dvr", baseDir);
 	setKey(keyPath);
 	free(keyPath);
-	
-	int append = 0;
-	char *buffer = calloc(1, filesize);
-	int read = fread(buffer, 1, filesize, file);
-	if (read == filesize) {
-		int i;
-		for (i = 0; i < (filesize - 5); i++) {
-			if (!memcmp(&buffer[i], "/mnt/", 5) && !memcmp(&buffer[i + strlen(&buffer[i]) - 3], "STR", 3)) {
-				
-				char *strName = strrchr(&buffer[i], '/') + 1;
-				char *filePath;
-				asprintf(&filePath, "%s/%s", baseDir, strName);
-				
-				printf("Converting file: %s -> %s\n", filePath, dest_file);
-				convertSTR2TS_internal(filePath, dest_file, append);
-				free(filePath);
-				
-				append = 1;
+
+	struct ts_part **parts = NULL;
+	int nparts = 0, first = 1, i;
+
+	// the parts are NUL terminated /mnt/.../NAME.STR paths, in order
+	const char *p = mdata(pif, char), *end = p + msize(pif);
+	while (p && (p = memmem(p, end - p, "/mnt/", 5)) != NULL) {
+		const char *nul = memchr(p, '\0', end - p);
+		size_t len = (nul ? nul : end) - p;
+
+		if (!memcmp(p + len - 3, "STR", 3)) {
+			const char *strName = memrchr(p, '/', len) + 1;
+			char *filePath;
+			asprintf(&filePath, "%s/%.*s", baseDir, (int)(p + len - strName), strName);
+
+			printf("Converting file: %s -> %s\n", filePath, dest_file);
+			struct ts_part *part = calloc(1, sizeof(struct ts_part));
+			// only the first part gets the PAT and PMT, the others are appended
+			if (part_open(part, filePath, first) == 0) {
+				parts = realloc(parts, sizeof(*parts) * (nparts + 1));
+				parts[nparts++] = part;
+			} else {
+				free(part);
 			}
+			free(filePath);
+			first = 0;
 		}
+		p += len;
 	}
-	fclose(file);
-	free(buffer);
+	mclose(pif);
+
+	int outFile = -1;
+	FILE *idx = NULL;
+	if (nparts > 0) {
+		outFile = open(dest_file, O_RDWR | O_CREAT | O_TRUNC, 0666);
+		if (outFile < 0)
+			printf("Can't open file %s\n", dest_file);
+		else
+			idx = index_open(dest_file, 0);
+	}
+
+	if (outFile >= 0) {
+		// each part goes to its own range, sized from the STR file alone
+		uint64_t offset = 0;
+		for (i = 0; i < nparts; i++) {
+			parts[i]->offset = offset;
+			parts[i]->size = part_max_size(parts[i]);
+			parts[i]->outFile = outFile;
+			parts[i]->outFilename = dest_file;
+			if (idx)
+				parts[i]->idx = open_memstream(&parts[i]->idxData, &parts[i]->idxLen);
+			offset += parts[i]->size;
+		}
+
+		int nThreads = sysconf(_SC_NPROCESSORS_ONLN);
+		pool = thpool_init(nThreads);
+		threadpool partPool = thpool_init(MIN(nparts, nThreads));
+		for (i = 0; i < nparts; i++)
+			thpool_add_work(partPool, (void *)part_convert, parts[i]);
+		thpool_wait(partPool);
+		thpool_destroy(partPool);
+		thpool_destroy(pool);
+		pool = NULL;
+
+		if (parts[0]->header)
+			write_pmt(outFile, dest_file, &parts[0]->PIDs);
+
+		// parts that lost sync don't fill their range, the next ones are moved down
+		offset = 0;
+		for (i = 0; i < nparts; i++) {
+			if (parts[i]->offset != offset && move_range(outFile, parts[i]->offset, offset, parts[i]->written) < 0)
+				printf("Can't write file %s (%s)\n", dest_file, strerror(errno));
+
+			// the index entries of the parts, in order
+			if (parts[i]->idx) {
+				fclose(parts[i]->idx);
+				index_append(idx, parts[i]->idxData, parts[i]->idxLen, (int64_t)(offset - parts[i]->offset));
+			}
+			offset += parts[i]->written;
+		}
+		if (ftruncate(outFile, offset) < 0)
+			printf("Can't write file %s (%s)\n", dest_file, strerror(errno));
+		if (idx)
+			fclose(idx);
+		close(outFile);
+	}
+
+	for (i = 0; i < nparts; i++)
+		part_close(parts[i]);
+	free(parts);
 	
 	free(baseDir);
 }
@@ -48,6 +48,8 @@ struct symfile_header {
 	uint32_t tail_size;
 }__attribute__((packed));
 
+#define NO_SYMBOL UINT32_MAX
+
 struct sym_table sym_table = {
 	.n_symbols = 0,
 	.sym_entry = NULL,
@@ -55,10 +57,172 @@ struct sym_table sym_table = {
 	.n_dwarf_lst = 0,
 	.dwarf_lst = NULL,
 	.dwarf_data = NULL,
-	.sym_name = NULL
+	.sym_name = NULL,
+	.ranges = NULL,
+	.n_ranges = 0,
+	.name_index = NULL,
+	.name_index_mask = 0
 };
 
-int symfile_load(const char *fname) {
+static const char *sym_name(const struct sym_table *table, uint32_t i) {
+	return table->sym_name + table->sym_entry[i].sym_name_off;
+}
+
+static uint32_t name_hash(const char *name) {
+	uint32_t h = 2166136261U;	// FNV-1a
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619U;
+	return h;
+}
+
+static int cmp_by_addr(const void *a, const void *b) {
+	const struct sym_range *x = a, *y = b;
+
+	if (x->start != y->start)
+		return (x->start < y->start) ? -1 : 1;
+	return 0;
+}
+
+/* Max-heap of symbol numbers, the symbols covering the current address */
+struct sym_heap {
+	uint32_t *v;
+	uint32_t n;
+};
+
+static void heap_push(struct sym_heap *h, uint32_t sym) {
+	uint32_t i = h->n++;
+
+	for (; i > 0 && h->v[(i - 1) / 2] < sym; i = (i - 1) / 2)
+		h->v[i] = h->v[(i - 1) / 2];
+	h->v[i] = sym;
+}
+
+static void heap_pop(struct sym_heap *h) {
+	uint32_t last = h->v[--h->n], i = 0, child;
+
+	while ((child = 2 * i + 1) < h->n) {
+		if (child + 1 < h->n && h->v[child + 1] > h->v[child])
+			child++;
+		if (h->v[child] <= last)
+			break;
+		h->v[i] = h->v[child];
+		i = child;
+	}
+	h->v[i] = last;
+}
+
+/*
+ * Builds the indexes of the table:
+ *  - names: an open addressing hash table of symbol numbers + 1. The
+ *    format of the hash table embedded in the file isn't known, so this
+ *    one is built instead
+ *  - addresses: the symbol ranges split into disjoint ranges, sorted by
+ *    start. Each one ends where the next one starts and maps to the last
+ *    symbol covering it, as the reverse scan used to find, or NO_SYMBOL
+ */
+static int symfile_build_index(struct sym_table *table) {
+	uint32_t n = table->n_symbols, i, j, size;
+	uint32_t *name_index;
+	struct sym_range *sym_ranges;
+	uint32_t n_sym_ranges = 0;
+
+	free(table->name_index);
+	free(table->ranges);
+	table->name_index = NULL;
+	table->ranges = NULL;
+	table->n_ranges = 0;
+
+	for (size = 16; size < n * 2; size <<= 1) ;
+	name_index = calloc(size, sizeof(*name_index));
+	table->name_index = name_index;
+	table->name_index_mask = size - 1;
+
+	// the first symbol of a name wins, as with the linear scan
+	for (i = 0; name_index && i < n; i++) {
+		for (j = name_hash(sym_name(table, i)) & (size - 1); name_index[j]; j = (j + 1) & (size - 1)) {
+			if (strcmp(sym_name(table, name_index[j] - 1), sym_name(table, i)) == 0)
+				break;
+		}
+		if (!name_index[j])
+			name_index[j] = i + 1;
+	}
+
+	/*
+	 * Sweep over the sorted start and end addresses, keeping the symbols
+	 * that cover the current address in a heap. Ended symbols are only
+	 * dropped once they reach the top
+	 */
+	struct sym_range *starts = malloc(sizeof(*starts) * (n + 1));
+	struct sym_range *ends = malloc(sizeof(*ends) * (n + 1));
+	struct sym_heap heap = { malloc(sizeof(uint32_t) * (n + 1)), 0 };
+	uint32_t n_starts = 0;
+
+	sym_ranges = malloc(sizeof(*sym_ranges) * (2 * n + 1));
+	table->ranges = sym_ranges;
+	if (!name_index || !starts || !ends || !heap.v || !sym_ranges) {
+		free(starts);
+		free(ends);
+		free(heap.v);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (table->sym_entry[i].addr >= table->sym_entry[i].end)
+			continue;
+		starts[n_starts].start = table->sym_entry[i].addr;
+		starts[n_starts].sym = i;
+		ends[n_starts].start = table->sym_entry[i].end;
+		ends[n_starts].sym = i;
+		n_starts++;
+	}
+	qsort(starts, n_starts, sizeof(*starts), cmp_by_addr);
+	qsort(ends, n_starts, sizeof(*ends), cmp_by_addr);
+
+	i = j = 0;
+	while (i < n_starts || j < n_starts) {
+		uint32_t addr = (i < n_starts && starts[i].start < ends[j].start) ? starts[i].start : ends[j].start;
+
+		for (; i < n_starts && starts[i].start == addr; i++)
+			heap_push(&heap, starts[i].sym);
+		for (; j < n_starts && ends[j].start == addr; j++) ;
+
+		while (heap.n && table->sym_entry[heap.v[0]].end <= addr)
+			heap_pop(&heap);
+
+		uint32_t sym = heap.n ? heap.v[0] : NO_SYMBOL;
+		if (n_sym_ranges && sym_ranges[n_sym_ranges - 1].sym == sym)
+			continue;
+		sym_ranges[n_sym_ranges].start = addr;
+		sym_ranges[n_sym_ranges].sym = sym;
+		n_sym_ranges++;
+	}
+
+	table->n_ranges = n_sym_ranges;
+
+	free(starts);
+	free(ends);
+	free(heap.v);
+	return 0;
+}
+
+/* Index in the ranges of the table of the range holding addr, from lo on */
+static uint32_t find_range(const struct sym_table *table, uint32_t addr, uint32_t lo) {
+	uint32_t hi = table->n_ranges;
+
+	// the last range starting at or before addr
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (table->ranges[mid].start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;	// one past it, 0 if addr is before all of them
+}
+
+int symfile_open(const char *fname, struct sym_table *table) {
 	int fd = -1;
 	struct stat st_buf;
 	void *p;
@@ -105,9 +269,9 @@ int symfile_load(const char *fname) {
 		return -1;
 	}
 
-	sym_table.n_symbols = header->n_symbols;
-	sym_table.sym_entry = p;
-	p += sizeof(sym_table.sym_entry[0]) * sym_table.n_symbols;
+	table->n_symbols = header->n_symbols;
+	table->sym_entry = p;
+	p += sizeof(table->sym_entry[0]) * table->n_symbols;
 
 	has_hash = p;
 	p += sizeof(*has_hash);
@@ -117,25 +281,30 @@ int symfile_load(const char *fname) {
 	}
 
 	if (*has_hash == 2) {
-		sym_table.hash = p;
-		p += sizeof(sym_table.hash[0]) * ((sym_table.n_symbols + 1) & (~0 - 1));
+		table->hash = p;
+		p += sizeof(table->hash[0]) * ((table->n_symbols + 1) & (~0 - 1));
 	}
 
 	has_dwarf = p;
 	p += sizeof(*has_dwarf);
 
 	if (*has_dwarf == 1) {
-		sym_table.n_dwarf_lst = *(uint32_t *) p;
-		p += sizeof(sym_table.n_dwarf_lst);
+		table->n_dwarf_lst = *(uint32_t *) p;
+		p += sizeof(table->n_dwarf_lst);
 		dwarf_data_size = *(uint32_t *) p;
 		p += sizeof(dwarf_data_size);
-		sym_table.dwarf_lst = p;
-		p += sizeof(sym_table.dwarf_lst[0]) * sym_table.n_dwarf_lst;
-		sym_table.dwarf_data = p;
+		table->dwarf_lst = p;
+		p += sizeof(table->dwarf_lst[0]) * table->n_dwarf_lst;
+		table->dwarf_data = p;
 		p += dwarf_data_size;
-		sym_table.sym_name = p;
+		table->sym_name = p;
 	} else {
-		sym_table.sym_name = (char *)has_dwarf;
+		table->sym_name = (char *)has_dwarf;
+	}
+
+	if (symfile_build_index(table) != 0) {
+		fprintf(stderr, "can't index `%s'\n", fname);
+		return -1;
 	}
 
 	printf("`%s' has been successfully loaded\n", fname);
@@ -143,13 +312,21 @@ int symfile_load(const char *fname) {
 	return 0;
 }
 
+int symfile_load(const char *fname) {
+	return symfile_open(fname, &sym_table);
+}
+
 uint32_t symfile_addr_by_name(const char *name) {
-	unsigned i = 0;
-	for (i = 0; i < sym_table.n_symbols; ++i) {
-		char *sym_name = sym_table.sym_name	+ sym_table.sym_entry[i].sym_name_off;
+	uint32_t j;
+
+	uint32_t *name_index = sym_table.name_index, mask = sym_table.name_index_mask;
 
-		if (strcmp(sym_name, name) == 0)
-			return sym_table.sym_entry[i].addr;
+	if (name_index == NULL)
+		return 0;
+
+	for (j = name_hash(name) & mask; name_index[j]; j = (j + 1) & mask) {
+		if (strcmp(sym_name(&sym_table, name_index[j] - 1), name) == 0)
+			return sym_table.sym_entry[name_index[j] - 1].addr;
 	}
 
 	return 0;
@@ -160,50 +337,28 @@ uint32_t symfile_n_symbols() {
 }
 
 void symfile_write_idc(const char *fname) {
+	symfile_export(&sym_table, fname, SYMFILE_IDC);
+}
 
-	FILE *outfile = fopen(fname, "w");
-
-	fprintf(outfile, "%s\n\n", "#include <idc.idc>");
-	fprintf(outfile, "%s\n", "static main() {");
-
-	unsigned i = 0;
-	for (i = 0; i < sym_table.n_symbols; ++i) {
-			char *sym_name = sym_table.sym_name
-					+ sym_table.sym_entry[i].sym_name_off;
-
-			uint32_t addr = sym_table.sym_entry[i].addr;
-			uint32_t end = sym_table.sym_entry[i].end;
-
-			//printf("%s: %x...%x\n", sym_name, addr, end);
-
-			fprintf(outfile, "MakeNameEx( 0x%x, \"%s\", SN_NOWARN | SN_CHECK);\n", addr, sym_name);
-
-			fprintf(outfile, "if(SegName(0x%x)==\".text\") {\n", addr);
-			fprintf(outfile, "   MakeCode(0x%x);\n", addr);
-			fprintf(outfile, "   MakeFunction(0x%x, 0x%x);\n", addr, end);
-			fprintf(outfile, "};\n", addr);
-
-	}
-
-	fprintf(outfile, "%s\n", "}");
-
-	fclose(outfile);
-
-	//printf("n_dwarf_lst: %d\n", sym_table.n_dwarf_lst);
-	//printf("dwarf_lst.d1: %d\n", sym_table.dwarf_lst->d1);
-	//printf("dwarf_lst.d2: %d\n", sym_table.dwarf_lst->d2);
-
-	//hexdump(sym_table.dwarf_data, 15000);
+const char *symfile_name_by_addr(uint32_t addr) {
+	uint32_t r = find_range(&sym_table, addr, 0);
 
+	if (r == 0 || sym_table.ranges[r - 1].sym == NO_SYMBOL)
+		return NULL;
+	return sym_name(&sym_table, sym_table.ranges[r - 1].sym);
 }
 
+void symfile_names_by_addr(const uint32_t *addrs, const char **names, size_t count) {
+	uint32_t r = 0;
+	size_t i;
 
-const char *symfile_name_by_addr(uint32_t addr) {
-	int i = 0;
-	for (i = sym_table.n_symbols - 1; i >= 0; --i) {
-		if (sym_table.sym_entry[i].addr <= addr && sym_table.sym_entry[i].end > addr)
-			return sym_table.sym_name + sym_table.sym_entry[i].sym_name_off;
-	}
+	for (i = 0; i < count; i++) {
+		// sorted addresses, as in most crash logs, only search forward
+		r = find_range(&sym_table, addrs[i], (i > 0 && addrs[i] >= addrs[i - 1] && r > 0) ? r - 1 : 0);
 
-	return NULL;
+		if (r == 0 || sym_table.ranges[r - 1].sym == NO_SYMBOL)
+			names[i] = NULL;
+		else
+			names[i] = sym_name(&sym_table, sym_table.ranges[r - 1].sym);
+	}
 }
@@ -0,0 +1,307 @@
+/*
+ * Exporters of the symbols of SYM files
+ *
+ * The symbols are split in chunks that the thread pool formats into
+ * memory, then the chunks are written out in order with a few large
+ * writes. Formats:
+ *  - SYMFILE_IDC: IDA script naming the symbols and making functions
+ *  - SYMFILE_MAP: "addr size name" lines, addr and size in hex
+ *  - SYMFILE_ELF: ELF32 object whose .symtab holds the symbols as
+ *    absolute functions, for tools that load symbols from ELF files
+ */
+
+#include <symfile.h>
+
+#include <elf.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "thpool.h"
+
+#define SYMS_PER_CHUNK 16384
+
+struct out_buf {
+	char *data;
+	size_t len;
+	size_t size;
+	int failed;
+};
+
+struct export_chunk {
+	const struct sym_table *table;
+	enum symfile_format format;
+	uint32_t first;
+	uint32_t last;
+	struct out_buf out;	/* text, or the ELF symbols */
+	struct out_buf str;	/* names of the ELF symbols */
+};
+
+static char *buf_reserve(struct out_buf *b, size_t len) {
+	if (b->len + len > b->size) {
+		size_t size = (b->size ? b->size : 4096);
+		char *data;
+
+		while (size < b->len + len)
+			size *= 2;
+		data = realloc(b->data, size);
+		if (data == NULL) {
+			b->failed = 1;
+			return NULL;
+		}
+		b->data = data;
+		b->size = size;
+	}
+	return b->data + b->len;
+}
+
+static void buf_put(struct out_buf *b, const void *data, size_t len) {
+	char *p = buf_reserve(b, len);
+
+	if (p) {
+		memcpy(p, data, len);
+		b->len += len;
+	}
+}
+
+#define buf_puts(b, s) buf_put(b, s, sizeof(s) - 1)
+
+/* Same as printf's %x */
+static void buf_hex(struct out_buf *b, uint32_t v) {
+	char tmp[8];
+	int n = 0;
+
+	do {
+		tmp[7 - n++] = "0123456789abcdef"[v & 0xF];
+		v >>= 4;
+	} while (v);
+	buf_put(b, tmp + 8 - n, n);
+}
+
+static void format_idc(struct export_chunk *chunk, uint32_t addr, uint32_t end, const char *name) {
+	struct out_buf *b = &chunk->out;
+
+	buf_puts(b, "MakeNameEx( 0x");
+	buf_hex(b, addr);
+	buf_puts(b, ", \"");
+	buf_put(b, name, strlen(name));
+	buf_puts(b, "\", SN_NOWARN | SN_CHECK);\n");
+
+	buf_puts(b, "if(SegName(0x");
+	buf_hex(b, addr);
+	buf_puts(b, ")==\".text\") {\n   MakeCode(0x");
+	buf_hex(b, addr);
+	buf_puts(b, ");\n   MakeFunction(0x");
+	buf_hex(b, addr);
+	buf_puts(b, ", 0x");
+	buf_hex(b, end);
+	buf_puts(b, ");\n};\n");
+}
+
+static void format_map(struct export_chunk *chunk, uint32_t addr, uint32_t end, const char *name) {
+	struct out_buf *b = &chunk->out;
+	uint32_t v = addr;
+	char tmp[8];
+	int i;
+
+	// addresses are zero padded so the map sorts as text too
+	for (i = 7; i >= 0; i--, v >>= 4)
+		tmp[i] = "0123456789abcdef"[v & 0xF];
+	buf_put(b, tmp, sizeof(tmp));
+	buf_puts(b, " ");
+	buf_hex(b, (end > addr) ? end - addr : 0);
+	buf_puts(b, " ");
+	buf_put(b, name, strlen(name));
+	buf_puts(b, "\n");
+}
+
+/*
+ * st_name is relative to the names of the chunk here, it's moved to the
+ * offset of those in .strtab when writing the chunk
+ */
+static void format_elf(struct export_chunk *chunk, uint32_t addr, uint32_t end, const char *name) {
+	Elf32_Sym sym;
+
+	memset(&sym, 0, sizeof(sym));
+	sym.st_name = chunk->str.len;
+	sym.st_value = addr;
+	sym.st_size = (end > addr) ? end - addr : 0;
+	sym.st_info = ELF32_ST_INFO(STB_GLOBAL, STT_FUNC);
+	sym.st_shndx = SHN_ABS;
+
+	buf_put(&chunk->out, &sym, sizeof(sym));
+	buf_put(&chunk->str, name, strlen(name) + 1);
+}
+
+static void format_chunk(struct export_chunk *chunk) {
+	const struct sym_table *table = chunk->table;
+	uint32_t i;
+
+	for (i = chunk->first; i < chunk->last; i++) {
+		const struct sym_entry *e = &table->sym_entry[i];
+		const char *name = table->sym_name + e->sym_name_off;
+
+		switch (chunk->format) {
+			case SYMFILE_IDC:
+				format_idc(chunk, e->addr, e->end, name);
+				break;
+			case SYMFILE_MAP:
+				format_map(chunk, e->addr, e->end, name);
+				break;
+			case SYMFILE_ELF:
+				format_elf(chunk, e->addr, e->end, name);
+				break;
+		}
+	}
+}
+
+static int write_out(FILE *fh, const void *data, size_t len) {
+	return (len == 0 || fwrite(data, len, 1, fh) == 1) ? 0 : -1;
+}
+
+static int write_elf(FILE *fh, struct export_chunk *chunks, int nchunks, uint32_t n_symbols) {
+	static const char shstrtab[] = "\0.symtab\0.strtab\0.shstrtab";
+	Elf32_Ehdr ehdr;
+	Elf32_Shdr shdr[4];
+	Elf32_Sym null_sym;
+	uint32_t str_size = 1, str_off;
+	int i;
+
+	for (i = 0; i < nchunks; i++)
+		str_size += chunks[i].str.len;
+
+	uint32_t symtab_off = sizeof(ehdr);
+	uint32_t symtab_size = sizeof(Elf32_Sym) * (n_symbols + 1);
+	uint32_t strtab_off = symtab_off + symtab_size;
+	uint32_t shstrtab_off = strtab_off + str_size;
+	uint32_t shdr_off = (shstrtab_off + sizeof(shstrtab) + 3) & ~3;
+
+	memset(&ehdr, 0, sizeof(ehdr));
+	memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+	ehdr.e_ident[EI_CLASS] = ELFCLASS32;
+	ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr.e_type = ET_REL;
+	ehdr.e_machine = EM_ARM;
+	ehdr.e_version = EV_CURRENT;
+	ehdr.e_shoff = shdr_off;
+	ehdr.e_ehsize = sizeof(ehdr);
+	ehdr.e_shentsize = sizeof(Elf32_Shdr);
+	ehdr.e_shnum = 4;
+	ehdr.e_shstrndx = 3;
+
+	memset(shdr, 0, sizeof(shdr));
+	shdr[1].sh_name = 1;
+	shdr[1].sh_type = SHT_SYMTAB;
+	shdr[1].sh_offset = symtab_off;
+	shdr[1].sh_size = symtab_size;
+	shdr[1].sh_link = 2;
+	shdr[1].sh_info = 1;	// all but the null symbol are global
+	shdr[1].sh_addralign = 4;
+	shdr[1].sh_entsize = sizeof(Elf32_Sym);
+	shdr[2].sh_name = 9;
+	shdr[2].sh_type = SHT_STRTAB;
+	shdr[2].sh_offset = strtab_off;
+	shdr[2].sh_size = str_size;
+	shdr[2].sh_addralign = 1;
+	shdr[3].sh_name = 17;
+	shdr[3].sh_type = SHT_STRTAB;
+	shdr[3].sh_offset = shstrtab_off;
+	shdr[3].sh_size = sizeof(shstrtab);
+	shdr[3].sh_addralign = 1;
+
+	memset(&null_sym, 0, sizeof(null_sym));
+	if (write_out(fh, &ehdr, sizeof(ehdr)) < 0 || write_out(fh, &null_sym, sizeof(null_sym)) < 0)
+		return -1;
+
+	// the names of each chunk follow those of the previous ones
+	for (i = 0, str_off = 1; i < nchunks; i++) {
+		Elf32_Sym *sym = (Elf32_Sym *)chunks[i].out.data;
+		size_t j, n = chunks[i].out.len / sizeof(Elf32_Sym);
+
+		for (j = 0; j < n; j++)
+			sym[j].st_name += str_off;
+		str_off += chunks[i].str.len;
+
+		if (write_out(fh, chunks[i].out.data, chunks[i].out.len) < 0)
+			return -1;
+	}
+
+	if (write_out(fh, "", 1) < 0)
+		return -1;
+	for (i = 0; i < nchunks; i++) {
+		if (write_out(fh, chunks[i].str.data, chunks[i].str.len) < 0)
+			return -1;
+	}
+
+	if (write_out(fh, shstrtab, sizeof(shstrtab)) < 0 ||
+		write_out(fh, "\0\0\0", shdr_off - shstrtab_off - sizeof(shstrtab)) < 0 ||
+		write_out(fh, shdr, sizeof(shdr)) < 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Writes the symbols of table to fname in the given format.
+ * Returns 0, or -1 on error
+ */
+int symfile_export(const struct sym_table *table, const char *fname, enum symfile_format format) {
+	int nchunks = (table->n_symbols + SYMS_PER_CHUNK - 1) / SYMS_PER_CHUNK;
+	struct export_chunk *chunks = calloc(nchunks ? nchunks : 1, sizeof(*chunks));
+	int i, ret = 0;
+
+	FILE *outfile = fopen(fname, "wb");
+	if (outfile == NULL || chunks == NULL) {
+		fprintf(stderr, "can't open `%s': %m\n", fname);
+		free(chunks);
+		if (outfile)
+			fclose(outfile);
+		return -1;
+	}
+
+	threadpool pool = thpool_init(sysconf(_SC_NPROCESSORS_ONLN));
+	for (i = 0; i < nchunks; i++) {
+		chunks[i].table = table;
+		chunks[i].format = format;
+		chunks[i].first = i * SYMS_PER_CHUNK;
+		chunks[i].last = (i + 1 < nchunks) ? (i + 1) * SYMS_PER_CHUNK : table->n_symbols;
+		thpool_add_work(pool, (void *)format_chunk, &chunks[i]);
+	}
+	thpool_wait(pool);
+	thpool_destroy(pool);
+
+	for (i = 0; i < nchunks; i++) {
+		if (chunks[i].out.failed || chunks[i].str.failed) {
+			fprintf(stderr, "out of memory exporting `%s'\n", fname);
+			ret = -1;
+		}
+	}
+
+	if (ret == 0 && format == SYMFILE_ELF) {
+		ret = write_elf(outfile, chunks, nchunks, table->n_symbols);
+	} else if (ret == 0) {
+		static const char idc_head[] = "#include <idc.idc>\n\nstatic main() {\n";
+
+		if (format == SYMFILE_IDC)
+			ret = write_out(outfile, idc_head, sizeof(idc_head) - 1);
+		for (i = 0; ret == 0 && i < nchunks; i++)
+			ret = write_out(outfile, chunks[i].out.data, chunks[i].out.len);
+		if (ret == 0 && format == SYMFILE_IDC)
+			ret = write_out(outfile, "}\n", 2);
+	}
+
+	if (fclose(outfile) != 0)
+		ret = -1;
+	if (ret != 0)
+		fprintf(stderr, "can't write `%s'\n", fname);
+
+	for (i = 0; i < nchunks; i++) {
+		free(chunks[i].out.data);
+		free(chunks[i].str.data);
+	}
+	free(chunks);
+	return ret;
+}
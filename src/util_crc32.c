@@ -0,0 +1,259 @@
+/*
+	CRC32 checksums
+
+	crc32_update() is a slicing-by-16 table CRC, replaced at startup by a
+	carry-less multiplication (PCLMULQDQ) or ARMv8 CRC32 instruction
+	version when the CPU has them.
+*/
+#include <stdint.h>
+#include <stddef.h>
+#include "util_crc32.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#    define CRC32_PCLMUL
+#    include <cpuid.h>
+#    include <wmmintrin.h>
+#    include <smmintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__linux__)
+#    define CRC32_ARMV8
+#    include <sys/auxv.h>
+#    ifndef HWCAP_CRC32
+#        define HWCAP_CRC32 (1 << 7)
+#    endif
+#endif
+
+#define CRC32_POLY		0xEDB88320
+#define CRC32_BE_POLY	0x04C11DB7
+
+static uint32_t crc_table[16][256];
+static uint32_t crc_be_table[256];
+
+static uint32_t crc32_slice16(uint32_t crc, const uint8_t *p, size_t len);
+static uint32_t (*crc32_fn)(uint32_t, const uint8_t *, size_t) = crc32_slice16;
+static const char *crc32_name = "slicing-by-16";
+
+static inline uint32_t read32le(const uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t crc32_bytes(uint32_t crc, const uint8_t *p, size_t len) {
+	while (len--)
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+static uint32_t crc32_slice16(uint32_t crc, const uint8_t *p, size_t len) {
+	const uint32_t (*t)[256] = (const uint32_t (*)[256])crc_table;
+
+	while (len >= 16) {
+		uint32_t a = read32le(p) ^ crc;
+		uint32_t b = read32le(p + 4);
+		uint32_t c = read32le(p + 8);
+		uint32_t d = read32le(p + 12);
+
+		crc = t[15][a & 0xff] ^ t[14][(a >> 8) & 0xff] ^ t[13][(a >> 16) & 0xff] ^ t[12][a >> 24] ^
+			t[11][b & 0xff] ^ t[10][(b >> 8) & 0xff] ^ t[9][(b >> 16) & 0xff] ^ t[8][b >> 24] ^
+			t[7][c & 0xff] ^ t[6][(c >> 8) & 0xff] ^ t[5][(c >> 16) & 0xff] ^ t[4][c >> 24] ^
+			t[3][d & 0xff] ^ t[2][(d >> 8) & 0xff] ^ t[1][(d >> 16) & 0xff] ^ t[0][d >> 24];
+
+		p += 16;
+		len -= 16;
+	}
+
+	return crc32_bytes(crc, p, len);
+}
+
+#ifdef CRC32_PCLMUL
+/*
+ * Folds 64 bytes at a time with carry-less multiplications, then reduces
+ * to 32 bits with Barrett reduction, as in Intel's "Fast CRC Computation
+ * for Generic Polynomials Using PCLMULQDQ Instruction". The constants
+ * are for the bit-reflected 0xEDB88320 polynomial.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *p, size_t len) {
+	static const uint64_t __attribute__((aligned(16))) k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+	static const uint64_t __attribute__((aligned(16))) k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+	static const uint64_t __attribute__((aligned(16))) k5k0[] = { 0x0163cd6124, 0x0000000000 };
+	static const uint64_t __attribute__((aligned(16))) poly[] = { 0x01db710641, 0x01f7011641 };
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	if (len < 64)
+		return crc32_slice16(crc, p, len);
+
+	x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i *)k1k2);
+	p += 64;
+	len -= 64;
+
+	// fold 4 x 128 bits in parallel
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(p + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(p + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(p + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(p + 0x30)));
+
+		p += 64;
+		len -= 64;
+	}
+
+	// fold into 128 bits
+	x0 = _mm_load_si128((const __m128i *)k3k4);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while (len >= 16) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)p)), x5);
+
+		p += 16;
+		len -= 16;
+	}
+
+	// fold 128 bits to 64
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett reduction to 32 bits
+	x0 = _mm_load_si128((const __m128i *)poly);
+
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	crc = _mm_extract_epi32(x1, 1);
+
+	return crc32_slice16(crc, p, len);
+}
+#endif
+
+#ifdef CRC32_ARMV8
+static inline uint32_t crc32_armv8_b(uint32_t crc, uint8_t v) {
+	__asm__(".arch_extension crc\n\tcrc32b %w0, %w0, %w1" : "+r"(crc) : "r"(v));
+	return crc;
+}
+
+static inline uint32_t crc32_armv8_x(uint32_t crc, uint64_t v) {
+	__asm__(".arch_extension crc\n\tcrc32x %w0, %w0, %x1" : "+r"(crc) : "r"(v));
+	return crc;
+}
+
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t *p, size_t len) {
+	while (len && ((uintptr_t)p & 7)) {
+		crc = crc32_armv8_b(crc, *p++);
+		len--;
+	}
+
+	while (len >= 32) {
+		const uint64_t *q = (const uint64_t *)p;
+
+		crc = crc32_armv8_x(crc, q[0]);
+		crc = crc32_armv8_x(crc, q[1]);
+		crc = crc32_armv8_x(crc, q[2]);
+		crc = crc32_armv8_x(crc, q[3]);
+		p += 32;
+		len -= 32;
+	}
+
+	while (len >= 8) {
+		crc = crc32_armv8_x(crc, *(const uint64_t *)p);
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = crc32_armv8_b(crc, *p++);
+
+	return crc;
+}
+#endif
+
+__attribute__((constructor))
+static void crc32_init(void) {
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		uint32_t crc = i, be = (uint32_t)i << 24;
+
+		for (j = 0; j < 8; j++) {
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32_POLY : 0);
+			be = (be << 1) ^ ((be & 0x80000000) ? CRC32_BE_POLY : 0);
+		}
+		crc_table[0][i] = crc;
+		crc_be_table[i] = be;
+	}
+
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 16; j++)
+			crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^ crc_table[0][crc_table[j - 1][i] & 0xff];
+
+#if defined(CRC32_PCLMUL)
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1)) {
+		crc32_fn = crc32_pclmul;
+		crc32_name = "pclmul";
+	}
+#elif defined(CRC32_ARMV8)
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+		crc32_fn = crc32_armv8;
+		crc32_name = "armv8-crc32";
+	}
+#endif
+}
+
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len) {
+	return crc32_fn(crc, (const uint8_t *)buf, len);
+}
+
+uint32_t crc32_ieee(const void *buf, size_t len) {
+	return ~crc32_fn(~0U, (const uint8_t *)buf, len);
+}
+
+uint32_t crc32_be_update(uint32_t crc, const void *buf, size_t len) {
+	const uint8_t *p = (const uint8_t *)buf;
+
+	while (len--)
+		crc = (crc << 8) ^ crc_be_table[((crc >> 24) ^ *p++) & 0xff];
+	return crc;
+}
+
+const char *crc32_impl(void) {
+	return crc32_name;
+}
@@ -0,0 +1,223 @@
+/*
+	Vectorized scanning of large images
+
+	Looks at 32 bytes per compare with AVX2, or 16 with SSE2, to skip over
+	erased (0xFF) or zeroed areas and to find candidate magic numbers or
+	stream sync bytes, so that the expensive checks only run where
+	something is.
+*/
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "util_memscan.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#    define MEMSCAN_X86
+#    include <cpuid.h>
+#    include <immintrin.h>
+#endif
+
+static inline uint16_t read16(const uint8_t *p) {
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static size_t memspan_generic(const uint8_t *p, size_t len, uint8_t c) {
+	uint64_t pattern = 0x0101010101010101ULL * c;
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, p + i, sizeof(w));
+		if (w != pattern)
+			break;
+	}
+	while (i < len && p[i] == c)
+		i++;
+	return i;
+}
+
+static size_t memfind_sync_generic(const uint8_t *p, size_t len, uint8_t c, size_t stride, int count) {
+	size_t span = stride * (count - 1), i;
+	int k;
+
+	for (i = 0; i + span < len; i++) {
+		const uint8_t *q = memchr(p + i, c, len - span - i);
+		if (q == NULL)
+			break;
+		i = q - p;
+		for (k = 1; k < count && p[i + k * stride] == c; k++) ;
+		if (k == count)
+			return i;
+	}
+	return len;
+}
+
+static size_t memfind_magic16_generic(const uint8_t *p, size_t len, uint16_t magic) {
+	uint16_t swapped = (magic >> 8) | (magic << 8);
+	size_t i;
+
+	for (i = 0; i + 2 <= len; i += 4) {
+		uint16_t v = read16(p + i);
+		if (v == magic || v == swapped)
+			return i;
+	}
+	return len;
+}
+
+#ifdef MEMSCAN_X86
+/* movemask bits of the 16-bit lanes at a multiple of 4 bytes */
+#define LANE4_MASK 0x11111111U
+
+static size_t memspan_sse2(const uint8_t *p, size_t len, uint8_t c) {
+	__m128i pattern = _mm_set1_epi8(c);
+	size_t i = 0;
+
+	for (; i + 64 <= len; i += 64) {
+		__m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), pattern);
+		__m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 16)), pattern);
+		__m128i c2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 32)), pattern);
+		__m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 48)), pattern);
+
+		if (_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), _mm_and_si128(c2, d))) != 0xFFFF)
+			break;
+	}
+	for (; i + 16 <= len; i += 16) {
+		unsigned int m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), pattern));
+		if (m != 0xFFFF)
+			return i + __builtin_ctz(~m);
+	}
+	return i + memspan_generic(p + i, len - i, c);
+}
+
+static size_t memfind_magic16_sse2(const uint8_t *p, size_t len, uint16_t magic) {
+	__m128i m1 = _mm_set1_epi16(magic);
+	__m128i m2 = _mm_set1_epi16((magic >> 8) | (magic << 8));
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		unsigned int m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi16(v, m1), _mm_cmpeq_epi16(v, m2))) & 0x1111;
+		if (m)
+			return i + __builtin_ctz(m);
+	}
+	i += memfind_magic16_generic(p + i, len - i, magic);
+	return (i < len) ? i : len;
+}
+
+static size_t memfind_sync_sse2(const uint8_t *p, size_t len, uint8_t c, size_t stride, int count) {
+	__m128i pattern = _mm_set1_epi8(c);
+	size_t span = stride * (count - 1), i = 0;
+	int k;
+
+	// 16 candidate offsets at a time, each tested at every stride
+	for (; i + span + 16 <= len; i += 16) {
+		__m128i m = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), pattern);
+		for (k = 1; k < count && _mm_movemask_epi8(m); k++)
+			m = _mm_and_si128(m, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + k * stride)), pattern));
+		unsigned int mask = _mm_movemask_epi8(m);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	i += memfind_sync_generic(p + i, len - i, c, stride, count);
+	return (i < len) ? i : len;
+}
+
+__attribute__((target("avx2")))
+static size_t memfind_sync_avx2(const uint8_t *p, size_t len, uint8_t c, size_t stride, int count) {
+	__m256i pattern = _mm256_set1_epi8(c);
+	size_t span = stride * (count - 1), i = 0;
+	int k;
+
+	for (; i + span + 32 <= len; i += 32) {
+		__m256i m = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), pattern);
+		for (k = 1; k < count && _mm256_movemask_epi8(m); k++)
+			m = _mm256_and_si256(m, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + k * stride)), pattern));
+		unsigned int mask = _mm256_movemask_epi8(m);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	i += memfind_sync_sse2(p + i, len - i, c, stride, count);
+	return (i < len) ? i : len;
+}
+
+__attribute__((target("avx2")))
+static size_t memspan_avx2(const uint8_t *p, size_t len, uint8_t c) {
+	__m256i pattern = _mm256_set1_epi8(c);
+	size_t i = 0;
+
+	for (; i + 64 <= len; i += 64) {
+		__m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), pattern);
+		__m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 32)), pattern);
+
+		if ((unsigned int)_mm256_movemask_epi8(_mm256_and_si256(a, b)) != 0xFFFFFFFFU)
+			break;
+	}
+	for (; i + 32 <= len; i += 32) {
+		unsigned int m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), pattern));
+		if (m != 0xFFFFFFFFU)
+			return i + __builtin_ctz(~m);
+	}
+	return i + memspan_sse2(p + i, len - i, c);
+}
+
+__attribute__((target("avx2")))
+static size_t memfind_magic16_avx2(const uint8_t *p, size_t len, uint16_t magic) {
+	__m256i m1 = _mm256_set1_epi16(magic);
+	__m256i m2 = _mm256_set1_epi16((magic >> 8) | (magic << 8));
+	size_t i = 0;
+
+	for (; i + 64 <= len; i += 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+		uint64_t m = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi16(a, m1), _mm256_cmpeq_epi16(a, m2))) & LANE4_MASK;
+		m |= (uint64_t)((uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi16(b, m1), _mm256_cmpeq_epi16(b, m2))) & LANE4_MASK) << 32;
+		if (m)
+			return i + __builtin_ctzll(m);
+	}
+	i += memfind_magic16_sse2(p + i, len - i, magic);
+	return (i < len) ? i : len;
+}
+#endif
+
+static size_t (*memspan_fn)(const uint8_t *, size_t, uint8_t) = memspan_generic;
+static size_t (*memfind_magic16_fn)(const uint8_t *, size_t, uint16_t) = memfind_magic16_generic;
+static size_t (*memfind_sync_fn)(const uint8_t *, size_t, uint8_t, size_t, int) = memfind_sync_generic;
+
+__attribute__((constructor))
+static void memscan_init(void) {
+#ifdef MEMSCAN_X86
+	unsigned int eax, ebx, ecx, edx;
+
+	memspan_fn = memspan_sse2;
+	memfind_magic16_fn = memfind_magic16_sse2;
+	memfind_sync_fn = memfind_sync_sse2;
+
+	// AVX2 also needs the OS to save the YMM registers
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_OSXSAVE) && (ecx & bit_AVX)) {
+		unsigned int xcr0_lo, xcr0_hi;
+
+		__asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+		if ((xcr0_lo & 6) == 6 && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_AVX2)) {
+			memspan_fn = memspan_avx2;
+			memfind_magic16_fn = memfind_magic16_avx2;
+			memfind_sync_fn = memfind_sync_avx2;
+		}
+	}
+#endif
+}
+
+size_t memspan(const void *buf, size_t len, uint8_t c) {
+	return memspan_fn((const uint8_t *)buf, len, c);
+}
+
+size_t memfind_magic16(const void *buf, size_t len, uint16_t magic) {
+	return memfind_magic16_fn((const uint8_t *)buf, len, magic);
+}
+
+size_t memfind_sync(const void *buf, size_t len, uint8_t c, size_t stride, int count) {
+	if (count < 1)
+		return 0;
+	return memfind_sync_fn((const uint8_t *)buf, len, c, stride, count);
+}